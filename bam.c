@@ -188,18 +188,32 @@ static void swap_endian_data(const bam1_core_t *c, int data_len, uint8_t *data)
 	}
 }
 
-int bam_read1(bamFile fp, bam1_t *b)
+// read the length and the core of an alignment; *p is set to the record if it lies in the current block
+static inline int bam_read1_core(bamFile fp, bam1_t *b, const uint8_t **p)
 {
 	bam1_core_t *c = &b->core;
 	int32_t block_len, ret, i;
 	uint32_t x[8];
 
 	assert(BAM_CORE_SIZE == 32);
-	if ((ret = bam_read(fp, &block_len, 4)) != 4) {
-		if (ret == 0) return -1; // normal end-of-file
-		else return -2; // truncated
+	*p = 0;
+#ifndef BAM_LITE
+	if (!bam_is_be && fp->block_length - fp->block_offset >= 4 + (int)BAM_CORE_SIZE) { // fast path: decode in place
+		const uint8_t *q = (uint8_t*)fp->uncompressed_block + fp->block_offset;
+		memcpy(&block_len, q, 4);
+		if (block_len >= (int)BAM_CORE_SIZE && block_len <= fp->block_length - fp->block_offset - 4) {
+			memcpy(x, q + 4, BAM_CORE_SIZE);
+			*p = q;
+		}
+	}
+#endif
+	if (*p == 0) {
+		if ((ret = bam_read(fp, &block_len, 4)) != 4) {
+			if (ret == 0) return -1; // normal end-of-file
+			else return -2; // truncated
+		}
+		if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
 	}
-	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
 	if (bam_is_be) {
 		bam_swap_endian_4p(&block_len);
 		for (i = 0; i < 8; ++i) bam_swap_endian_4p(x + i);
@@ -210,18 +224,105 @@ int bam_read1(bamFile fp, bam1_t *b)
 	c->l_qseq = x[4];
 	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
 	b->data_len = block_len - BAM_CORE_SIZE;
+	return block_len;
+}
+
+// read the variable-length data following bam_read1_core(); b->data must have room for b->data_len bytes
+static inline int bam_read1_data(bamFile fp, bam1_t *b, const uint8_t *p)
+{
+	bam1_core_t *c = &b->core;
+#ifndef BAM_LITE
+	if (p) {
+		memcpy(b->data, p + 4 + BAM_CORE_SIZE, b->data_len);
+		fp->block_offset += 4 + BAM_CORE_SIZE + b->data_len;
+		if (fp->block_offset == fp->block_length) { // the same as at the end of bgzf_read()
+			fp->block_address = bgzf_next_address(fp);
+			fp->block_offset = fp->block_length = 0;
+		}
+	} else
+#endif
+	if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
+	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
+	if (bam_is_be) swap_endian_data(c, b->data_len, b->data);
+	if (bam_no_B) bam_remove_B(b);
+	return 0;
+}
+
+int bam_read1(bamFile fp, bam1_t *b)
+{
+	int32_t block_len;
+	const uint8_t *p;
+	if ((block_len = bam_read1_core(fp, b, &p)) < 0) return block_len;
 	if (b->m_data < b->data_len) {
 		b->m_data = b->data_len;
 		kroundup32(b->m_data);
 		b->data = (uint8_t*)realloc(b->data, b->m_data);
 	}
-	if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
-	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
-	if (bam_is_be) swap_endian_data(c, b->data_len, b->data);
-	if (bam_no_B) bam_remove_B(b);
+	if (bam_read1_data(fp, b, p) < 0) return -4;
 	return 4 + block_len;
 }
 
+bam_batch_t *bam_batch_init()
+{
+	return (bam_batch_t*)calloc(1, sizeof(bam_batch_t));
+}
+
+void bam_batch_destroy(bam_batch_t *bb)
+{
+	if (bb == 0) return;
+	free(bb->b); free(bb->arena);
+	free(bb);
+}
+
+int bam_read_batch(bamFile fp, bam_batch_t *bb, int max_records)
+{
+	int ret = 0;
+	bb->n = 0; bb->l_arena = 0;
+	if (bb->m < max_records) {
+		bb->b = (bam1_t*)realloc(bb->b, max_records * sizeof(bam1_t));
+		bb->m = max_records;
+	}
+	while (bb->n < max_records) {
+		bam1_t *b = &bb->b[bb->n];
+		const uint8_t *p;
+		size_t size;
+		if ((ret = bam_read1_core(fp, b, &p)) < 0) break;
+		size = b->data_len;
+		if (bam_no_B) size += (b->core.n_cigar + 1) * 4; // so that bam_remove_B() does not reallocate
+		size = (size + 7) & ~(size_t)7; // keep each record 8-byte aligned
+		if (bb->l_arena + size > bb->m_arena) { // grow the arena and relocate the records read so far
+			uint8_t *arena;
+			int i;
+			if (bb->m_arena == 0) bb->m_arena = 0x10000;
+			while (bb->m_arena < bb->l_arena + size) bb->m_arena <<= 1;
+			arena = (uint8_t*)malloc(bb->m_arena);
+			if (bb->l_arena) memcpy(arena, bb->arena, bb->l_arena);
+			for (i = 0; i < bb->n; ++i)
+				bb->b[i].data = arena + (bb->b[i].data - bb->arena);
+			free(bb->arena);
+			bb->arena = arena;
+		}
+		b->data = bb->arena + bb->l_arena;
+		b->m_data = size;
+		if ((ret = bam_read1_data(fp, b, p)) < 0) break;
+		bb->l_arena += size;
+		++bb->n;
+	}
+	return ret < -1? ret : bb->n;
+}
+
+int bam_write_batch(bamFile fp, const bam_batch_t *bb)
+{
+	int i, ret, l = 0;
+	for (i = 0; i < bb->n; ++i) {
+		if ((ret = bam_write1(fp, &bb->b[i])) < 0) return -1;
+		l += ret;
+	}
+	return l;
+}
+
+void bam_index_otf_push(bamFile fp, const bam1_core_t *c, uint8_t *data); // in bam_index.c
+
 inline int bam_write1_core(bamFile fp, const bam1_core_t *c, int data_len, uint8_t *data)
 {
 	uint32_t x[8], block_len = data_len + BAM_CORE_SIZE, y;
@@ -245,6 +346,7 @@ inline int bam_write1_core(bamFile fp, const bam1_core_t *c, int data_len, uint8
 	bam_write(fp, x, BAM_CORE_SIZE);
 	bam_write(fp, data, data_len);
 	if (bam_is_be) swap_endian_data(c, data_len, data);
+	if (fp->idx_build) bam_index_otf_push(fp, c, data);
 	return 4 + block_len;
 }
 
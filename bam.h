@@ -207,8 +207,37 @@ typedef struct {
 	uint8_t *data;
 } bam1_t;
 
+/*! @typedef
+  @abstract Structure for a batch of alignments read in one go.
+  @field  n        number of alignments in the batch
+  @field  m        number of allocated alignments
+  @field  b        alignments; b[i].data points into arena
+  @field  l_arena  length of the used part of the arena
+  @field  m_arena  maximum length of the arena
+  @field  arena    packed variable-length data of all alignments
+
+  @discussion The data of an alignment in a batch belongs to the arena:
+  it must not be freed or reallocated, so functions that may grow
+  bam1_t::data, such as bam_aux_append(), must not be applied to b[i].
+  Use bam_dup1() to take a modifiable copy. The alignments are
+  overwritten by the next bam_read_batch() call.
+ */
+typedef struct {
+	int n, m;
+	bam1_t *b;
+	size_t l_arena, m_arena;
+	uint8_t *arena;
+} bam_batch_t;
+
 typedef struct __bam_iter_t *bam_iter_t;
 
+/*! @typedef
+  @abstract Region [beg,end) on reference tid, 0-based
+ */
+typedef struct {
+	int tid, beg, end;
+} bam_region_t;
+
 #define bam1_strand(b) (((b)->core.flag&BAM_FREVERSE) != 0)
 #define bam1_mstrand(b) (((b)->core.flag&BAM_FMREVERSE) != 0)
 
@@ -462,6 +491,28 @@ extern "C" {
 	 */
 	int bam_write1(bamFile fp, const bam1_t *b);
 
+	bam_batch_t *bam_batch_init();
+	void bam_batch_destroy(bam_batch_t *bb);
+
+	/*!
+	  @abstract   Read up to max_records alignments from BAM.
+	  @param  fp  BAM file handler
+	  @param  bb  batch to fill; previous alignments are discarded
+	  @param  max_records  maximum number of alignments to read
+	  @return     number of alignments read, 0 at the end of file, or the
+	              negative error code of bam_read1() on errors
+
+	  @discussion On errors, the bb->n alignments read before the error
+	  are still valid.
+	 */
+	int bam_read_batch(bamFile fp, bam_batch_t *bb, int max_records);
+
+	/*!
+	  @abstract   Write all alignments in a batch to BAM.
+	  @return     number of bytes written, or -1 on errors
+	 */
+	int bam_write_batch(bamFile fp, const bam_batch_t *bb);
+
 	/*! @function
 	  @abstract  Initiate a pointer to bam1_t struct
 	 */
@@ -530,6 +581,37 @@ extern "C" {
 
 	typedef int (*bam_plp_auto_f)(void *data, bam1_t *b);
 
+	/*! @typedef
+	  @abstract Structure-of-arrays view of a pileup column.
+	  @field  n       number of reads in the column
+	  @field  base4   4-bit encoded read base, as returned by bam1_seqi()
+	  @field  baseQ   base quality
+	  @field  mapQ    mapping quality
+	  @field  strand  1 for reads on the reverse strand; 0 otherwise
+	  @field  flag    BAM_PLP_* flags copied from bam_pileup1_t
+	  @field  qpos    position of the read base, 0-based
+	  @field  indel   indel length, as bam_pileup1_t::indel
+
+	  @discussion Filled by bam_plp_col() in one pass over the column, so
+	  that statistics over the reads do not need to fetch the alignments.
+	  At deletions and reference skips, and for reads without a sequence,
+	  base4 is 15 (N) and baseQ is 0. The arrays are reused
+	  across columns; free them with bam_plp_col_destroy().
+	 */
+	typedef struct {
+		int n, m;
+		uint8_t *base4, *baseQ, *mapQ, *strand, *flag;
+		int32_t *qpos, *indel;
+	} bam_plp_col_t;
+
+#define BAM_PLP_DEL     1
+#define BAM_PLP_REFSKIP 2
+#define BAM_PLP_HEAD    4
+#define BAM_PLP_TAIL    8
+
+	int bam_plp_col(bam_plp_col_t *col, int n, const bam_pileup1_t *plp);
+	void bam_plp_col_destroy(bam_plp_col_t *col);
+
 	struct __bam_plp_t;
 	typedef struct __bam_plp_t *bam_plp_t;
 
@@ -541,6 +623,9 @@ extern "C" {
 	void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt);
 	void bam_plp_reset(bam_plp_t iter);
 	void bam_plp_destroy(bam_plp_t iter);
+	/* Numbers of columns and of read positions (the sum of the column
+	 * depths) returned by the iterator since bam_plp_init(). */
+	void bam_plp_stat(const bam_plp_t iter, uint64_t *n_pos, uint64_t *n_rpos);
 
 	struct __bam_mplp_t;
 	typedef struct __bam_mplp_t *bam_mplp_t;
@@ -548,6 +633,13 @@ extern "C" {
 	bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data);
 	void bam_mplp_destroy(bam_mplp_t iter);
 	void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt);
+	/* With flag set, bam_mplp_auto() only clears the entries it set on the
+	 * previous call, so that the cost per column scales with the number of
+	 * inputs covering it. The caller must then pass the same n_plp and plp
+	 * on every call and not modify them in between. */
+	void bam_mplp_set_partial_clear(bam_mplp_t iter, int flag);
+	/* n_plp[i] and plp[i] are set to 0 for inputs not covering the
+	 * returned column. */
 	int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
 
 	/*! @typedef
@@ -606,12 +698,91 @@ extern "C" {
 	int bam_index_build(const char *fn);
 
 	/*!
-	  @abstract   Load index from file "fn.bai".
+	  @abstract     Build index for a BAM file, decompressing with multiple threads.
+	  @param  fn    name of the BAM file
+	  @param  fnidx name of the index file; "fn.bai" if NULL
+	  @param  n_threads  number of decompression threads
+	  @return       0 on success; -1 on failure
+	 */
+	int bam_index_build3(const char *fn, const char *fnidx, int n_threads);
+
+	/*!
+	  @abstract     Build a BAI or CSI index for a BAM file.
+	  @param  fn    name of the BAM file
+	  @param  fnidx name of the index file; "fn.bai" or "fn.csi" if NULL
+	  @param  n_threads  number of decompression threads
+	  @param  min_shift  CSI bins at the bottom level span 2^min_shift bp;
+	                     0 for BAI
+	  @param  n_lvls     number of CSI levels below bin 0; raised as needed
+	                     to cover the longest reference, so 0 picks the
+	                     smallest depth. Ignored for BAI.
+	  @return       0 on success; -1 on failure
+	 */
+	int bam_index_build4(const char *fn, const char *fnidx, int n_threads, int min_shift, int n_lvls);
+
+	/*!
+	  @abstract     Start building the index of a BAM file being written.
+	  @param  fp    BAM file opened for writing, with the header written
+	  @param  n_targets  number of reference sequences in the header
+	  @return       0 on success; -1 on failure
+
+	  @discussion Alignments written afterwards with bam_write1() are
+	  indexed as they are written, in the multi-threaded mode as well;
+	  they must be sorted by coordinate. Call bam_index_otf_save() before
+	  bam_close(). The index is identical to that built by bam_index_build().
+	 */
+	int bam_index_otf_init(bamFile fp, int n_targets);
+
+	/*!
+	  @abstract     Finish the index started by bam_index_otf_init().
+	  @param  fp    BAM file being written; pending data are flushed
+	  @param  fn    name of the BAM file; index file "fn.bai" will be created
+	  @return       0 on success; -1 on failure, e.g. if the alignments
+	                are not sorted
+	 */
+	int bam_index_otf_save(bamFile fp, const char *fn);
+
+	/*!
+	  @abstract   Load index from file "fn.bai", "fn.csi" or "{base}.bai".
 	  @param  fn  name of the BAM file (NOT the index file)
 	  @return     pointer to the index structure
+
+	  @discussion The index file is memory-mapped and the data of a
+	  reference are only parsed when it is first queried. The index may
+	  be queried from several threads.
 	 */
 	bam_index_t *bam_index_load(const char *fn);
 
+	/*!
+	  @abstract   Load the index of a local file, as bam_index_load() does, without trying to download it.
+	  @param  fn  name of the BAM file (NOT the index file)
+	  @return     pointer to the index structure, or NULL if there is no index file
+	 */
+	bam_index_t *bam_index_load_local(const char *fn);
+
+	/*!
+	  @abstract   Virtual offset where the reads without coordinates start.
+	  @param  idx pointer to the index structure
+	  @return     the offset, or 0 if no alignment is placed and they follow
+	              the header; -1 if the file has no such reads
+	 */
+	int64_t bam_index_no_coor_off(const bam_index_t *idx);
+
+	/*!
+	  @abstract       Cut an indexed BAM file into parts of similar size at alignment boundaries.
+	  @param  idx     pointer to the index structure
+	  @param  size    size of the BAM file in bytes
+	  @param  n       number of parts wanted
+	  @param  n_parts number of parts returned, at most n
+	  @return         virtual offsets where the parts start, NULL if no alignments are indexed
+
+	  @discussion Part i ends where part i+1 starts and the last part at the
+	  end of the file, after the reads without coordinates. The cuts are
+	  taken from the chunk boundaries in the index, so a part may be much
+	  larger than requested where the index has no boundary.
+	 */
+	uint64_t *bam_index_cut(const bam_index_t *idx, int64_t size, int n, int *n_parts);
+
 	/*!
 	  @abstract    Destroy an index structure.
 	  @param  idx  pointer to the index structure
@@ -643,6 +814,17 @@ extern "C" {
 	int bam_fetch(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, void *data, bam_fetch_f func);
 
 	bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end);
+
+	/*!
+	  @abstract Iterate over the alignments overlapping any of n regions.
+
+	  @discussion The regions may be given in any order and may overlap;
+	  they are sorted and merged, and their chunks are merged into one
+	  list, so that each block of the file is read at most once.
+	  bam_iter_read() returns each alignment once, in the file order.
+	  Regions on references not in the index are ignored.
+	 */
+	bam_iter_t bam_iter_query_many(const bam_index_t *idx, const bam_region_t *regs, int n);
 	int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b);
 	void bam_iter_destroy(bam_iter_t iter);
 
@@ -33,13 +33,12 @@ void bcf_call_destroy(bcf_callaux_t *bca)
 {
 	if (bca == 0) return;
 	errmod_destroy(bca->e);
-	free(bca->bases); free(bca->inscns); free(bca);
+	free(bca->bases); free(bca->inscns); free(bca->var_pos); free(bca);
 }
 /* ref_base is the 4-bit representation of the reference base. It is
  * negative if we are looking at an indel. */
 int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
 {
-    static int *var_pos = NULL, nvar_pos = 0;
 	int i, n, ref4, is_indel, ori_depth = 0;
 	memset(r, 0, sizeof(bcf_callret1_t));
 	if (ref_base >= 0) {
@@ -98,10 +97,11 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
 	errmod_cal(bca->e, n, 5, bca->bases, r->p);
 
     // Calculate the Variant Distance Bias (make it optional?)
-    if ( nvar_pos < _n ) {
-        nvar_pos = _n;
-        var_pos = realloc(var_pos,sizeof(int)*nvar_pos);
+    if ( bca->nvar_pos < _n ) {
+        bca->nvar_pos = _n;
+        bca->var_pos = realloc(bca->var_pos,sizeof(int)*bca->nvar_pos);
     }
+    int *var_pos = bca->var_pos;
     int alt_dp=0, read_len=0;
     for (i=0; i<_n; i++) {
         const bam_pileup1_t *p = pl + i;
@@ -22,6 +22,7 @@ typedef struct __bcf_callaux_t {
 	int maxins, indelreg;
 	char *inscns;
 	uint16_t *bases;
+	int nvar_pos, *var_pos; // scratch for the variant distance bias
 	errmod_t *e;
 	void *rghash;
 } bcf_callaux_t;
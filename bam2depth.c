@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "bam.h"
+#include "kstring.h"
+
+#define DEPTH_OUT_BLOCK 0x10000 // output is written in blocks of this size
 
 typedef struct {     // auxiliary data structure
 	bamFile fp;      // the file handler
@@ -60,6 +63,7 @@ int main_depth(int argc, char *argv[])
 	bam_header_t *h = 0; // BAM header of the 1st input
 	aux_t **data;
 	bam_mplp_t mplp;
+	kstring_t out; // buffered output; formatted with kputw() as printf() is slow
         circos_t circos; circos.bin_size = 10000;
 
 	// parse the command line
@@ -101,6 +105,7 @@ int main_depth(int argc, char *argv[])
 	}
 
 	// the core multi-pileup loop
+	out.l = out.m = 0; out.s = 0;
 	mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
 	n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
 	plp = calloc(n, sizeof(void*)); // plp[i] points to the array of covering reads (internal in mplp)
@@ -108,7 +113,7 @@ int main_depth(int argc, char *argv[])
 		int32_t cov = 0;
 		if (pos < beg || pos >= end) continue; // out of range; skip
 		if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue; // not in BED; skip
-		if (0 == use_circos) { fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); } // a customized printf() would be faster
+		if (0 == use_circos) { kputs(h->target_name[tid], &out); kputc('\t', &out); kputw(pos+1, &out); }
 		for (i = 0; i < n; ++i) { // base level filters have to go here
 			int j, m = 0;
 			for (j = 0; j < n_plp[i]; ++j) {
@@ -116,11 +121,16 @@ int main_depth(int argc, char *argv[])
                         if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
                         else if (bam1_qual(p->b)[p->qpos] < baseQ) ++m; // low base quality
                     }
-                    if (0 == use_circos) printf("\t%d", n_plp[i] - m); // this the depth to output
+                    if (0 == use_circos) { kputc('\t', &out); kputw(n_plp[i] - m, &out); } // this the depth to output
                     else cov += (n_plp[i] - m);
                 }
-                if (0 == use_circos) putchar('\n');
-                else {
+                if (0 == use_circos) {
+                    kputc('\n', &out);
+                    if (out.l >= DEPTH_OUT_BLOCK) {
+                        fwrite(out.s, 1, out.l, stdout);
+                        out.l = 0;
+                    }
+                } else {
                     pos++; // make one-based
                     int32_t bin_idx = ((pos - (pos % circos.bin_size)) / circos.bin_size);
                     if (tid == circos.tid && bin_idx == circos.bin_idx) {
@@ -135,7 +145,8 @@ int main_depth(int argc, char *argv[])
                     }
                 }
 	}
-	free(n_plp); free(plp);
+	if (out.l) fwrite(out.s, 1, out.l, stdout);
+	free(out.s); free(n_plp); free(plp);
 	bam_mplp_destroy(mplp);
         if (1 == use_circos) circos_print(&circos, h); // print
 
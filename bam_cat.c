@@ -110,11 +110,10 @@ int bam_cat(int nfn, char * const *fn, const bam_header_t *h, const char* outbam
         j=0;
 #ifdef _USE_KNETFILE
         fp_file=fp->x.fpw;
-        while ((len = knet_read(in->x.fpr, buf, BUF_SIZE)) > 0) {
 #else  
         fp_file=fp->file;
-        while (!feof(in->file) && (len = fread(buf, 1, BUF_SIZE, in->file)) > 0) {
 #endif
+        while ((len = bgzf_raw_read(in, buf, BUF_SIZE)) > 0) {
             if(len<es){
                 int diff=es-len;
                 if(j==0) {
@@ -1,5 +1,14 @@
 #include <ctype.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(_WIN32) && !defined(BAM_NO_MMAP)
+#define BAM_INDEX_MMAP
+#include <sys/mman.h>
+#endif
 #include "bam.h"
 #include "khash.h"
 #include "ksort.h"
@@ -36,6 +45,13 @@
   region is short, typically only a few alignments in six bins need to
   be retrieved. The overlapping alignments can be quickly fetched.
 
+  The coordinate-sorted index (CSI) generalizes this scheme: the smallest
+  bins span 2^min_shift bp and there are n_lvls levels below bin 0, so
+  that the index addresses 2^(min_shift+3*n_lvls) bp. BAI is the special
+  case min_shift=14, n_lvls=5. CSI does not keep the linear index; each
+  bin instead records the smallest offset of the alignments overlapping
+  its first 2^min_shift window, which plays the same role in queries.
+
  */
 
 #define BAM_MIN_CHUNK_GAP 32768
@@ -43,6 +59,7 @@
 #define BAM_LIDX_SHIFT    14
 
 #define BAM_MAX_BIN 37450 // =(8^6-1)/7+1
+#define BAM_N_LVLS  5 // levels below bin 0 in BAI
 
 typedef struct {
 	uint64_t u, v;
@@ -53,6 +70,7 @@ KSORT_INIT(off, pair64_t, pair64_lt)
 
 typedef struct {
 	uint32_t m, n;
+	uint64_t loff; // CSI only: the first offset in the first window of the bin
 	pair64_t *list;
 } bam_binlist_t;
 
@@ -63,13 +81,75 @@ typedef struct {
 
 KHASH_MAP_INIT_INT(i, bam_binlist_t)
 
+// the bins of a reference sorted by number, pointing into the hash table
+typedef struct {
+	uint32_t bin;
+	bam_binlist_t *p;
+} bam_binptr_t;
+
+typedef struct {
+	int n;
+	bam_binptr_t *a;
+} bam_binvec_t;
+
+#define binptr_lt(a,b) ((a).bin < (b).bin)
+KSORT_INIT(bin, bam_binptr_t, binptr_lt)
+
+typedef struct __index_lazy_t index_lazy_t;
+
 struct __bam_index_t {
 	int32_t n;
+	int32_t min_shift, n_lvls; // 14 and 5 for BAI
+	uint32_t meta_bin; // pseudo-bin for the per-reference offsets and counts
+	int is_csi;
 	uint64_t n_no_coor; // unmapped reads without coordinate
 	khash_t(i) **index;
-	bam_lidx_t *index2;
+	bam_lidx_t *index2; // empty when CSI is loaded from a file
+	bam_binvec_t *sorted; // for queries; set once index is complete
+	index_lazy_t *lazy; // for an index loaded from a file; see index_touch()
 };
 
+static inline void index_touch(const bam_index_t *idx, int tid);
+static void lazy_destroy(index_lazy_t *l);
+
+// the first bin at level l, counting bin 0 as level 0
+#define bin_first(l) (((1<<(((l)<<1)+(l))) - 1) / 7)
+
+static void index_set_scheme(bam_index_t *idx, int min_shift, int n_lvls)
+{
+	idx->is_csi = (min_shift > 0);
+	idx->min_shift = min_shift > 0? min_shift : BAM_LIDX_SHIFT;
+	idx->n_lvls = min_shift > 0? n_lvls : BAM_N_LVLS;
+	idx->meta_bin = bin_first(idx->n_lvls + 1) + 1;
+}
+
+// the smallest bin containing [beg,end); identical to bam_reg2bin() for BAI
+static inline int csi_reg2bin(int64_t beg, int64_t end, int min_shift, int n_lvls)
+{
+	int l, s = min_shift, t = bin_first(n_lvls);
+	for (--end, l = n_lvls; l > 0; --l, s += 3, t -= 1<<((l<<1)+l))
+		if (beg>>s == end>>s) return t + (beg>>s);
+	return 0;
+}
+
+// the first window of the linear index covered by bin
+static inline int csi_bin_bot(int bin, int n_lvls)
+{
+	int l, b;
+	for (l = 0, b = bin; b; ++l, b = (b - 1) >> 3);
+	return (bin - bin_first(l)) << (n_lvls - l) * 3;
+}
+
+static inline uint32_t csi_aln_bin(const bam_index_t *idx, const bam1_core_t *c, uint8_t *data)
+{
+	int64_t beg = c->pos > 0? c->pos : 0, end = beg + 1;
+	if (c->n_cigar && !(c->flag & BAM_FUNMAP)) {
+		end = bam_calend(c, (uint32_t*)(data + c->l_qname));
+		if (end <= beg) end = beg + 1;
+	}
+	return csi_reg2bin(beg, end, idx->min_shift, idx->n_lvls);
+}
+
 // requirement: len <= LEN_MASK
 static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t end)
 {
@@ -79,7 +159,7 @@ static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t
 	k = kh_put(i, h, bin, &ret);
 	l = &kh_value(h, k);
 	if (ret) { // not present
-		l->m = 1; l->n = 0;
+		l->m = 1; l->n = 0; l->loff = 0;
 		l->list = (pair64_t*)calloc(l->m, 16);
 	}
 	if (l->n == l->m) {
@@ -89,11 +169,11 @@ static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t
 	l->list[l->n].u = beg; l->list[l->n++].v = end;
 }
 
-static inline void insert_offset2(bam_lidx_t *index2, bam1_t *b, uint64_t offset)
+static inline void insert_offset2(bam_lidx_t *index2, const bam1_core_t *c, const uint32_t *cigar, uint64_t offset, int shift)
 {
 	int i, beg, end;
-	beg = b->core.pos >> BAM_LIDX_SHIFT;
-	end = (bam_calend(&b->core, bam1_cigar(b)) - 1) >> BAM_LIDX_SHIFT;
+	beg = c->pos >> shift;
+	end = (bam_calend(c, cigar) - 1) >> shift;
 	if (index2->m < end + 1) {
 		int old_m = index2->m;
 		index2->m = end + 1;
@@ -120,7 +200,7 @@ static void merge_chunks(bam_index_t *idx)
 		index = idx->index[i];
 		for (k = kh_begin(index); k != kh_end(index); ++k) {
 			bam_binlist_t *p;
-			if (!kh_exist(index, k) || kh_key(index, k) == BAM_MAX_BIN) continue;
+			if (!kh_exist(index, k) || kh_key(index, k) == idx->meta_bin) continue;
 			p = &kh_value(index, k);
 			m = 0;
 			for (l = 1; l < p->n; ++l) {
@@ -137,6 +217,29 @@ static void merge_chunks(bam_index_t *idx)
 #endif // defined(BAM_TRUE_OFFSET) || defined(BAM_BGZF)
 }
 
+static void sort_bins_ref(bam_index_t *idx, int i)
+{
+	khash_t(i) *index = idx->index[i];
+	bam_binvec_t *b = &idx->sorted[i];
+	khint_t k;
+	if (kh_size(index) == 0) return;
+	b->a = (bam_binptr_t*)malloc(kh_size(index) * sizeof(bam_binptr_t));
+	for (k = kh_begin(index); k != kh_end(index); ++k) {
+		if (!kh_exist(index, k) || kh_key(index, k) == idx->meta_bin) continue;
+		b->a[b->n].bin = kh_key(index, k);
+		b->a[b->n++].p = &kh_value(index, k);
+	}
+	ks_introsort(bin, b->n, b->a);
+}
+
+// set up the sorted bins; index must not be modified afterwards
+static void sort_bins(bam_index_t *idx)
+{
+	int i;
+	idx->sorted = (bam_binvec_t*)calloc(idx->n, sizeof(bam_binvec_t));
+	for (i = 0; i < idx->n; ++i) sort_bins_ref(idx, i);
+}
+
 static void fill_missing(bam_index_t *idx)
 {
 	int i, j;
@@ -145,99 +248,486 @@ static void fill_missing(bam_index_t *idx)
 		for (j = 1; j < idx2->n; ++j)
 			if (idx2->offset[j] == 0)
 				idx2->offset[j] = idx2->offset[j-1];
+		if (idx->is_csi) { // CSI keeps the linear index in the bins
+			khash_t(i) *index = idx->index[i];
+			khint_t k;
+			for (k = kh_begin(index); k != kh_end(index); ++k) {
+				int bot;
+				if (!kh_exist(index, k) || kh_key(index, k) == idx->meta_bin) continue;
+				bot = csi_bin_bot(kh_key(index, k), idx->n_lvls);
+				kh_value(index, k).loff = bot < idx2->n? idx2->offset[bot] : 0;
+			}
+		}
 	}
 }
 
-bam_index_t *bam_index_core(bamFile fp)
-{
-	bam1_t *b;
-	bam_header_t *h;
-	int i, ret;
+/* The index is built incrementally: index_build_push() takes the
+ * alignments in the file order, each with the offset right after it. The
+ * offsets may be virtual offsets or any positions that increase with the
+ * file (see bgzf_utell()); merge_chunks() and fill_missing() must only
+ * be applied once they are virtual offsets. */
+typedef struct {
+	int32_t tid;
+	uint32_t bin;
+	uint64_t beg, end;
+} index_event_t;
+
+typedef struct {
 	bam_index_t *idx;
 	uint32_t last_bin, save_bin;
 	int32_t last_coor, last_tid, save_tid;
-	bam1_core_t *c;
 	uint64_t save_off, last_off, n_mapped, n_unmapped, off_beg, off_end, n_no_coor;
+	int no_coor, error; // no_coor: only reads without coordinates are expected
+	int is_log, n_log, m_log; // with is_log, the binning index is recorded in log[] in the insertion order
+	index_event_t *log;
+	char *msg; // with is_log, the error message is kept here until the part is joined
+} index_build_t;
+
+static int index_build_error(index_build_t *ib, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	if (ib->is_log) {
+		ib->msg = (char*)malloc(1024);
+		vsnprintf(ib->msg, 1024, fmt, ap);
+	} else vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return (ib->error = -1);
+}
+
+static inline void index_build_add(index_build_t *ib, int32_t tid, uint32_t bin, uint64_t beg, uint64_t end)
+{
+	index_event_t *e;
+	if (!ib->is_log) {
+		insert_offset(ib->idx->index[tid], bin, beg, end);
+		return;
+	}
+	if (ib->n_log == ib->m_log) {
+		ib->m_log = ib->m_log? ib->m_log<<1 : 256;
+		ib->log = (index_event_t*)realloc(ib->log, ib->m_log * sizeof(index_event_t));
+	}
+	e = &ib->log[ib->n_log++];
+	e->tid = tid; e->bin = bin; e->beg = beg; e->end = end;
+}
+
+// min_shift==0 for BAI
+static index_build_t *index_build_init(int n_targets, uint64_t off, int min_shift, int n_lvls)
+{
+	index_build_t *ib;
+	bam_index_t *idx;
+	int i;
+	ib = (index_build_t*)calloc(1, sizeof(index_build_t));
+	idx = ib->idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	idx->n = n_targets;
+	index_set_scheme(idx, min_shift, n_lvls);
+	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
+	for (i = 0; i < idx->n; ++i) idx->index[i] = kh_init(i);
+	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+	ib->save_bin = ib->save_tid = ib->last_tid = ib->last_bin = 0xffffffffu;
+	ib->save_off = ib->last_off = ib->off_beg = ib->off_end = off;
+	ib->last_coor = 0xffffffffu;
+	return ib;
+}
+
+// add an alignment ending at offset end; return 0 on success or -1 if the alignments are not sorted
+static int index_build_push(index_build_t *ib, const bam1_core_t *c, uint8_t *data, uint64_t end)
+{
+	bam_index_t *idx = ib->idx;
+	uint32_t bin = c->bin;
+	if (ib->error) return -1;
+	if (ib->no_coor) {
+		++ib->n_no_coor;
+		if (c->tid >= 0) {
+			return index_build_error(ib, "[bam_index_core] the alignment is not sorted: reads without coordinates prior to reads with coordinates.\n");
+		}
+		return 0;
+	}
+	if (c->tid < 0) ++ib->n_no_coor;
+	if (ib->last_tid < c->tid || (ib->last_tid >= 0 && c->tid < 0)) { // change of chromosomes
+		ib->last_tid = c->tid;
+		ib->last_bin = 0xffffffffu;
+	} else if ((uint32_t)ib->last_tid > (uint32_t)c->tid) {
+		return index_build_error(ib, "[bam_index_core] the alignment is not sorted (%s): %d-th chr > %d-th chr\n",
+				(char*)data, ib->last_tid+1, c->tid+1);
+	} else if ((int32_t)c->tid >= 0 && ib->last_coor > c->pos) {
+		return index_build_error(ib, "[bam_index_core] the alignment is not sorted (%s): %u > %u in %d-th chr\n",
+				(char*)data, ib->last_coor, c->pos, c->tid+1);
+	}
+	if (c->tid >= 0) {
+		if ((int64_t)c->pos >= 1LL << (idx->min_shift + 3 * idx->n_lvls)) {
+			return index_build_error(ib, "[bam_index_core] the alignment (%s) at %d in %d-th chr is beyond the range of the index; use a CSI index with more levels.\n",
+					(char*)data, c->pos + 1, c->tid+1);
+		}
+		if (idx->is_csi) bin = csi_aln_bin(idx, c, data);
+		if (!(c->flag & BAM_FUNMAP)) insert_offset2(&idx->index2[c->tid], c, (uint32_t*)(data + c->l_qname), ib->last_off, idx->min_shift);
+	}
+	if (bin != ib->last_bin) { // then possibly write the binning index
+		if (ib->save_bin != 0xffffffffu) // save_bin==0xffffffffu only happens to the first record
+			index_build_add(ib, ib->save_tid, ib->save_bin, ib->save_off, ib->last_off);
+		if (ib->last_bin == 0xffffffffu && ib->save_tid != 0xffffffffu) { // write the meta element
+			ib->off_end = ib->last_off;
+			index_build_add(ib, ib->save_tid, idx->meta_bin, ib->off_beg, ib->off_end);
+			index_build_add(ib, ib->save_tid, idx->meta_bin, ib->n_mapped, ib->n_unmapped);
+			ib->n_mapped = ib->n_unmapped = 0;
+			ib->off_beg = ib->off_end;
+		}
+		ib->save_off = ib->last_off;
+		ib->save_bin = ib->last_bin = bin;
+		ib->save_tid = c->tid;
+		if (ib->save_tid < 0) {
+			ib->no_coor = 1;
+			return 0;
+		}
+	}
+	if (end <= ib->last_off) {
+		return index_build_error(ib, "[bam_index_core] bug in BGZF/RAZF: %llx < %llx\n",
+				(unsigned long long)end, (unsigned long long)ib->last_off);
+	}
+	if (c->flag & BAM_FUNMAP) ++ib->n_unmapped;
+	else ++ib->n_mapped;
+	ib->last_off = end;
+	ib->last_coor = c->pos;
+	return 0;
+}
+
+// write the pending chunks and free ib; the offsets are still those passed to index_build_push()
+static bam_index_t *index_build_finish(index_build_t *ib)
+{
+	bam_index_t *idx = ib->idx;
+	if (!ib->no_coor && ib->save_tid >= 0) {
+		insert_offset(idx->index[ib->save_tid], ib->save_bin, ib->save_off, ib->last_off);
+		insert_offset(idx->index[ib->save_tid], idx->meta_bin, ib->off_beg, ib->last_off);
+		insert_offset(idx->index[ib->save_tid], idx->meta_bin, ib->n_mapped, ib->n_unmapped);
+	}
+	idx->n_no_coor = ib->n_no_coor;
+	if (ib->error) {
+		bam_index_destroy(idx);
+		idx = 0;
+	}
+	free(ib->log); free(ib->msg); free(ib);
+	return idx;
+}
+
+// return the number of CSI levels for the references in h, at least n_lvls, or -1 if too many are needed
+static int index_csi_lvls(const bam_header_t *h, int min_shift, int n_lvls)
+{
+	int64_t max_len = 0, s;
+	int i, n;
+	if (min_shift == 0) return BAM_N_LVLS;
+	for (i = 0; i < h->n_targets; ++i)
+		if (max_len < h->target_len[i]) max_len = h->target_len[i];
+	max_len += 256;
+	for (n = 0, s = 1LL<<min_shift; max_len > s; ++n, s <<= 3);
+	if (n < n_lvls) n = n_lvls;
+	if (n > 9 || min_shift + 3 * n > 40) { // bins must fit in an int
+		fprintf(stderr, "[bam_index_core] too many levels for a CSI index with min_shift %d.\n", min_shift);
+		return -1;
+	}
+	return n;
+}
+
+static bam_index_t *bam_index_core2(bamFile fp, int min_shift, int n_lvls)
+{
+	bam1_t *b;
+	bam_header_t *h;
+	int ret;
+	bam_index_t *idx;
+	index_build_t *ib;
 
 	h = bam_header_read(fp);
 	if(h == 0) {
 	    fprintf(stderr, "[bam_index_core] Invalid BAM header.");
 	    return NULL;
 	}
-
-	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	if ((n_lvls = index_csi_lvls(h, min_shift, n_lvls)) < 0) {
+		bam_header_destroy(h);
+		return NULL;
+	}
+	ib = index_build_init(h->n_targets, bam_tell(fp), min_shift, n_lvls);
+	bam_header_destroy(h);
 	b = (bam1_t*)calloc(1, sizeof(bam1_t));
-	c = &b->core;
+	while ((ret = bam_read1(fp, b)) >= 0)
+		if (index_build_push(ib, &b->core, b->data, bam_tell(fp)) < 0) break;
+	if (ret < -1) fprintf(stderr, "[bam_index_core] truncated file? Continue anyway. (%d)\n", ret);
+	free(b->data); free(b);
+	if ((idx = index_build_finish(ib)) == 0) return NULL;
+	merge_chunks(idx);
+	fill_missing(idx);
+	sort_bins(idx);
+	return idx;
+}
 
-	idx->n = h->n_targets;
-	bam_header_destroy(h);
-	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
-	for (i = 0; i < idx->n; ++i) idx->index[i] = kh_init(i);
-	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+bam_index_t *bam_index_core(bamFile fp)
+{
+	return bam_index_core2(fp, 0, 0);
+}
+
+/* Multi-threaded indexing. The file is cut at BGZF blocks found near
+ * evenly spaced file offsets, and each part starts at the first alignment
+ * that seems to begin in its first block. The parts are indexed in
+ * parallel and then joined in order. Joining checks that the previous
+ * part ended exactly where the next one starts, and reindexes the next
+ * part from there otherwise, so a wrong guess only costs time. As every
+ * part but the first logs its binning index instead of filling the hash
+ * tables, the joined index is built by the same sequence of insertions as
+ * the serial one, and is thus identical to it. */
+typedef struct {
+	const char *fn;
+	int64_t beg, end; // virtual offsets of the part; end<0 for the end of file
+	int64_t stop; // where reading stopped
+	int ret; // the last return value of bam_read1()
+	index_build_t *ib;
+	bam1_t *first; // the first alignment and its end
+	uint64_t first_end;
+	index_build_t w0; // the state of ib after the first alignment
+} index_part_t;
+
+static void *index_part_worker(void *data)
+{
+	index_part_t *p = (index_part_t*)data;
+	bamFile fp;
+	bam1_t *b;
+	p->stop = -1; p->ret = 0;
+	if ((fp = bam_open(p->fn, "r")) == 0) return 0;
+	if (bam_seek(fp, p->beg, SEEK_SET) == 0) {
+		b = bam_init1();
+		while ((p->end < 0 || bam_tell(fp) < p->end) && (p->ret = bam_read1(fp, b)) >= 0) {
+			bam1_core_t *c = &b->core;
+			if (c->tid < -1 || c->tid >= p->ib->idx->n || c->l_qname + 4 * c->n_cigar > b->data_len) { // garbage after a wrong guess
+				p->ib->error = -1;
+				break;
+			}
+			if (index_build_push(p->ib, c, b->data, bam_tell(fp)) < 0) break;
+			if (p->ib->is_log && p->first == 0) {
+				p->first = bam_dup1(b);
+				p->first_end = bam_tell(fp);
+				p->w0 = *p->ib;
+			}
+		}
+		p->stop = bam_tell(fp);
+		bam_destroy1(b);
+	}
+	bam_close(fp);
+	return 0;
+}
 
-	save_bin = save_tid = last_tid = last_bin = 0xffffffffu;
-	save_off = last_off = bam_tell(fp); last_coor = 0xffffffffu;
-	n_mapped = n_unmapped = n_no_coor = off_end = 0;
-	off_beg = off_end = bam_tell(fp);
-	while ((ret = bam_read1(fp, b)) >= 0) {
-		if (c->tid < 0) ++n_no_coor;
-		if (last_tid < c->tid || (last_tid >= 0 && c->tid < 0)) { // change of chromosomes
-			last_tid = c->tid;
-			last_bin = 0xffffffffu;
-		} else if ((uint32_t)last_tid > (uint32_t)c->tid) {
-			fprintf(stderr, "[bam_index_core] the alignment is not sorted (%s): %d-th chr > %d-th chr\n",
-					bam1_qname(b), last_tid+1, c->tid+1);
-			return NULL;
-		} else if ((int32_t)c->tid >= 0 && last_coor > c->pos) {
-			fprintf(stderr, "[bam_index_core] the alignment is not sorted (%s): %u > %u in %d-th chr\n",
-					bam1_qname(b), last_coor, c->pos, c->tid+1);
-			return NULL;
+// append the part indexed by the logging builder p->ib, which must directly follow the alignments in ib
+static int index_build_join(index_build_t *ib, index_part_t *p)
+{
+	index_build_t *w = p->ib, *w0 = &p->w0;
+	int i, i_meta = -1;
+	if (p->first == 0) return 0;
+	// the first alignment is added to ib normally; after that ib and w only
+	// differ in where the pending chunk and meta element start and in the counts
+	if (index_build_push(ib, &p->first->core, p->first->data, p->first_end) < 0) return -1;
+	if (w->error) {
+		if (w->msg) fputs(w->msg, stderr);
+		return (ib->error = -1);
+	}
+	for (i = 0; i < w->n_log; ++i) {
+		index_event_t *e = &w->log[i];
+		uint64_t beg = e->beg, end = e->end;
+		if (i == 0) beg = ib->save_off; // the chunk of the first alignment
+		else if (e->bin == ib->idx->meta_bin && i_meta < 0) i_meta = i, beg = ib->off_beg;
+		else if (i == i_meta + 1) beg += ib->n_mapped - w0->n_mapped, end += ib->n_unmapped - w0->n_unmapped;
+		insert_offset(ib->idx->index[e->tid], e->bin, beg, end);
+	}
+	if (w->n_log == 0) w->save_off = ib->save_off;
+	if (i_meta < 0) {
+		w->off_beg = ib->off_beg;
+		w->n_mapped += ib->n_mapped - w0->n_mapped;
+		w->n_unmapped += ib->n_unmapped - w0->n_unmapped;
+	}
+	w->n_no_coor += ib->n_no_coor - w0->n_no_coor;
+	for (i = 0; i < ib->idx->n; ++i) { // the linear index keeps the first offset of each window
+		bam_lidx_t *l = &ib->idx->index2[i], *lw = &w->idx->index2[i];
+		int j;
+		if (lw->m == 0) continue;
+		if (l->m < lw->m) {
+			l->offset = (uint64_t*)realloc(l->offset, lw->m * 8);
+			memset(l->offset + l->m, 0, 8 * (lw->m - l->m));
+			l->m = lw->m;
 		}
-		if (c->tid >= 0 && !(c->flag & BAM_FUNMAP)) insert_offset2(&idx->index2[b->core.tid], b, last_off);
-		if (c->bin != last_bin) { // then possibly write the binning index
-			if (save_bin != 0xffffffffu) // save_bin==0xffffffffu only happens to the first record
-				insert_offset(idx->index[save_tid], save_bin, save_off, last_off);
-			if (last_bin == 0xffffffffu && save_tid != 0xffffffffu) { // write the meta element
-				off_end = last_off;
-				insert_offset(idx->index[save_tid], BAM_MAX_BIN, off_beg, off_end);
-				insert_offset(idx->index[save_tid], BAM_MAX_BIN, n_mapped, n_unmapped);
-				n_mapped = n_unmapped = 0;
-				off_beg = off_end;
+		// windows past lw->n, set by a long alignment before a shorter one, reappear if n grows again
+		for (j = 0; j < lw->m; ++j)
+			if (l->offset[j] == 0) l->offset[j] = lw->offset[j];
+		l->n = lw->n;
+	}
+	ib->last_bin = w->last_bin; ib->save_bin = w->save_bin;
+	ib->last_coor = w->last_coor; ib->last_tid = w->last_tid; ib->save_tid = w->save_tid;
+	ib->save_off = w->save_off; ib->last_off = w->last_off;
+	ib->n_mapped = w->n_mapped; ib->n_unmapped = w->n_unmapped;
+	ib->off_beg = w->off_beg; ib->off_end = w->off_end; ib->n_no_coor = w->n_no_coor;
+	ib->no_coor = w->no_coor;
+	return 0;
+}
+
+// return the length of the alignment at p[0..n) if it is plausible, or -1
+static int64_t index_check_aln(const uint8_t *p, int64_t n, int n_targets, uint32_t max_bin, int32_t *tid, int32_t *pos)
+{
+	int32_t x[9];
+	int j, l_qname, n_cigar;
+	if (n < 36) return -1;
+	memcpy(x, p, 36);
+	l_qname = x[3] & 0xff; n_cigar = x[4] & 0xffff;
+	if (x[1] < -1 || x[1] >= n_targets || x[6] < -1 || x[6] >= n_targets || x[2] < -1 || x[7] < -1) return -1;
+	if (l_qname < 1 || x[5] < 0 || (uint32_t)x[3]>>16 >= max_bin) return -1;
+	if (32 + l_qname + 4 * n_cigar + (int64_t)(x[5] + 1) / 2 + x[5] > x[0]) return -1;
+	if (36 + l_qname <= n) {
+		if (p[36 + l_qname - 1] != 0) return -1;
+		for (j = 0; j < l_qname - 1; ++j)
+			if (p[36 + j] < 33 || p[36 + j] > 126) return -1;
+	}
+	*tid = x[1]; *pos = x[2];
+	return 4 + (int64_t)x[0];
+}
+
+#define INDEX_PROBE_SIZE 0x20000
+
+// find a BGZF block starting at or after file offset off; return its offset or -1
+static int64_t index_find_block(FILE *fp, int64_t off, int64_t size)
+{
+	static const uint8_t magic[16] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 0, 6, 0, 'B', 'C', 2, 0 };
+	uint8_t *buf;
+	int i, n, ret = -1;
+#define is_block_header(q) (memcmp(q, magic, 4) == 0 && memcmp((q) + 10, magic + 10, 6) == 0)
+	buf = (uint8_t*)malloc(INDEX_PROBE_SIZE);
+	if (fseeko(fp, off, SEEK_SET) == 0) {
+		n = fread(buf, 1, INDEX_PROBE_SIZE, fp);
+		for (i = 0; i + 18 <= n && i < 0x10000; ++i) {
+			int bsize;
+			if (!is_block_header(buf + i)) continue;
+			bsize = (buf[i+16] | buf[i+17]<<8) + 1;
+			if (off + i + bsize == size || (i + bsize + 18 <= n && is_block_header(buf + i + bsize))) {
+				ret = off + i;
+				break;
 			}
-			save_off = last_off;
-			save_bin = last_bin = c->bin;
-			save_tid = c->tid;
-			if (save_tid < 0) break;
 		}
-		if (bam_tell(fp) <= last_off) {
-			fprintf(stderr, "[bam_index_core] bug in BGZF/RAZF: %llx < %llx\n",
-					(unsigned long long)bam_tell(fp), (unsigned long long)last_off);
-			return NULL;
+	}
+#undef is_block_header
+	free(buf);
+	return ret;
+}
+
+// return the virtual offset of the first alignment that seems to start in the block at addr, or -1
+static int64_t index_find_aln(bamFile fp, int64_t addr, int n_targets, uint32_t max_bin)
+{
+	uint8_t *buf;
+	int64_t i, n, len0, ret = -1;
+	if (bam_seek(fp, addr << 16, SEEK_SET) < 0 || bgzf_read_block(fp) < 0 || fp->block_length == 0) return -1;
+	len0 = fp->block_length;
+	buf = (uint8_t*)malloc(INDEX_PROBE_SIZE);
+	n = bam_read(fp, buf, INDEX_PROBE_SIZE);
+	for (i = 0; i < len0 && i < n; ++i) {
+		int64_t q = i, l;
+		int k = 0;
+		int32_t tid, pos, last_tid = 0, last_pos = 0;
+		// a few consecutive alignments, sorted by coordinate
+		while (k < 8 && (l = index_check_aln(buf + q, n - q, n_targets, max_bin, &tid, &pos)) > 0) {
+			if (k && ((uint32_t)tid < (uint32_t)last_tid || (tid == last_tid && tid >= 0 && pos < last_pos))) break;
+			last_tid = tid, last_pos = pos;
+			q += l, ++k;
+		}
+		if (k == 8 || (n - q < 36 && (k >= 2 || q > n))) {
+			ret = addr << 16 | i;
+			break;
 		}
-		if (c->flag & BAM_FUNMAP) ++n_unmapped;
-		else ++n_mapped;
-		last_off = bam_tell(fp);
-		last_coor = b->core.pos;
 	}
-	if (save_tid >= 0) {
-		insert_offset(idx->index[save_tid], save_bin, save_off, bam_tell(fp));
-		insert_offset(idx->index[save_tid], BAM_MAX_BIN, off_beg, bam_tell(fp));
-		insert_offset(idx->index[save_tid], BAM_MAX_BIN, n_mapped, n_unmapped);
+	free(buf);
+	return ret;
+}
+
+static bam_index_t *bam_index_core_mt(const char *fn, int n_threads, int min_shift, int n_lvls)
+{
+	bamFile fp;
+	bam_header_t *h;
+	FILE *fpraw;
+	index_part_t *part;
+	pthread_t *tid;
+	index_build_t *ib;
+	bam_index_t *idx;
+	int i, n_parts, n_targets;
+	int64_t size, end;
+	uint32_t max_bin = min_shift? 1<<16 : BAM_MAX_BIN; // the bin field is not used by CSI and may overflow
+
+	if ((fp = bam_open(fn, "r")) == 0) return 0;
+	if ((h = bam_header_read(fp)) == 0) {
+		fprintf(stderr, "[bam_index_core] Invalid BAM header.");
+		bam_close(fp);
+		return 0;
 	}
-	merge_chunks(idx);
-	fill_missing(idx);
-	if (ret >= 0) {
-		while ((ret = bam_read1(fp, b)) >= 0) {
-			++n_no_coor;
-			if (c->tid >= 0 && n_no_coor) {
-				fprintf(stderr, "[bam_index_core] the alignment is not sorted: reads without coordinates prior to reads with coordinates.\n");
-				return NULL;
+	n_targets = h->n_targets;
+	n_lvls = index_csi_lvls(h, min_shift, n_lvls);
+	bam_header_destroy(h);
+	if (n_lvls < 0) {
+		bam_close(fp);
+		return 0;
+	}
+	part = (index_part_t*)calloc(n_threads, sizeof(index_part_t));
+	part[0].beg = bam_tell(fp);
+	n_parts = 1;
+	if (!bam_is_be && (fpraw = fopen(fn, "rb")) != 0) { // find the starts of the parts
+		fseeko(fpraw, 0, SEEK_END);
+		size = ftello(fpraw);
+		for (i = 1; i < n_threads; ++i) {
+			int64_t addr, voff;
+			if ((addr = index_find_block(fpraw, size / n_threads * i, size)) < 0) continue;
+			if ((voff = index_find_aln(fp, addr, n_targets, max_bin)) <= part[n_parts-1].beg) continue;
+			part[n_parts++].beg = voff;
+		}
+		fclose(fpraw);
+	}
+	bam_close(fp);
+	if (n_parts == 1) { // too small or not a local file; decompress with multiple threads instead
+		free(part);
+		if ((fp = bam_open(fn, "r")) == 0) return 0;
+		bgzf_mt(fp, n_threads, 256);
+		idx = bam_index_core2(fp, min_shift, n_lvls);
+		bam_close(fp);
+		return idx;
+	}
+	for (i = 0; i < n_parts; ++i) {
+		part[i].fn = fn;
+		part[i].end = i < n_parts - 1? part[i+1].beg : -1;
+		part[i].ib = index_build_init(n_targets, part[i].beg, min_shift, n_lvls);
+		part[i].ib->is_log = (i > 0);
+	}
+	tid = (pthread_t*)calloc(n_parts, sizeof(pthread_t));
+	for (i = 1; i < n_parts; ++i) pthread_create(&tid[i], 0, index_part_worker, &part[i]);
+	index_part_worker(&part[0]);
+	for (i = 1; i < n_parts; ++i) pthread_join(tid[i], 0);
+	free(tid);
+	ib = part[0].ib;
+	for (i = 0, end = 0; i < n_parts && end >= 0 && !ib->error; ++i) {
+		index_part_t *p = &part[i];
+		if (i > 0) {
+			if (p->beg != end) { // a wrong guess; index the part again from where the previous one stopped
+				bam_index_destroy(index_build_finish(p->ib));
+				if (p->first) bam_destroy1(p->first);
+				p->first = 0;
+				p->beg = end;
+				p->ib = index_build_init(n_targets, p->beg, min_shift, n_lvls);
+				p->ib->is_log = 1;
+				index_part_worker(p);
 			}
+			index_build_join(ib, p);
+		}
+		if (p->stop < 0) ib->error = -1;
+		end = p->stop;
+		if (p->ret < -1) { // like bam_index_core(), ignore the rest of the file
+			fprintf(stderr, "[bam_index_core] truncated file? Continue anyway. (%d)\n", p->ret);
+			end = -1;
 		}
 	}
-	if (ret < -1) fprintf(stderr, "[bam_index_core] truncated file? Continue anyway. (%d)\n", ret);
-	free(b->data); free(b);
-	idx->n_no_coor = n_no_coor;
+	for (i = 1; i < n_parts; ++i) {
+		bam_index_destroy(index_build_finish(part[i].ib));
+		if (part[i].first) bam_destroy1(part[i].first);
+	}
+	free(part);
+	if ((idx = index_build_finish(ib)) == 0) return 0;
+	merge_chunks(idx);
+	fill_missing(idx);
+	sort_bins(idx);
 	return idx;
 }
 
@@ -249,21 +739,72 @@ void bam_index_destroy(bam_index_t *idx)
 	for (i = 0; i < idx->n; ++i) {
 		khash_t(i) *index = idx->index[i];
 		bam_lidx_t *index2 = idx->index2 + i;
+		if (index == 0) continue; // not loaded
 		for (k = kh_begin(index); k != kh_end(index); ++k) {
 			if (kh_exist(index, k))
 				free(kh_value(index, k).list);
 		}
 		kh_destroy(i, index);
 		free(index2->offset);
+		if (idx->sorted) free(idx->sorted[i].a);
 	}
-	free(idx->index); free(idx->index2);
+	free(idx->index); free(idx->index2); free(idx->sorted);
+	lazy_destroy(idx->lazy);
 	free(idx);
 }
 
+static inline void save_u32(FILE *fp, uint32_t x)
+{
+	if (bam_is_be) bam_swap_endian_4p(&x);
+	fwrite(&x, 4, 1, fp);
+}
+
+static inline void save_u64(FILE *fp, uint64_t x)
+{
+	if (bam_is_be) bam_swap_endian_8p(&x);
+	fwrite(&x, 8, 1, fp);
+}
+
+static void bam_index_save_csi(const bam_index_t *idx, FILE *fp)
+{
+	int32_t i;
+	uint32_t j;
+	khint_t k;
+	for (i = 0; i < idx->n; ++i) index_touch(idx, i);
+	fwrite("CSI\1", 1, 4, fp);
+	save_u32(fp, idx->min_shift);
+	save_u32(fp, idx->n_lvls);
+	save_u32(fp, 0); // no auxiliary data for BAM
+	save_u32(fp, idx->n);
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx->index[i];
+		save_u32(fp, kh_size(index));
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			bam_binlist_t *p;
+			if (!kh_exist(index, k)) continue;
+			p = &kh_value(index, k);
+			save_u32(fp, kh_key(index, k));
+			save_u64(fp, p->loff);
+			save_u32(fp, p->n);
+			for (j = 0; j < p->n; ++j) {
+				save_u64(fp, p->list[j].u);
+				save_u64(fp, p->list[j].v);
+			}
+		}
+	}
+	save_u64(fp, idx->n_no_coor);
+	fflush(fp);
+}
+
 void bam_index_save(const bam_index_t *idx, FILE *fp)
 {
 	int32_t i, size;
 	khint_t k;
+	if (idx->is_csi) {
+		bam_index_save_csi(idx, fp);
+		return;
+	}
+	for (i = 0; i < idx->n; ++i) index_touch(idx, i);
 	fwrite("BAI\1", 1, 4, fp);
 	if (bam_is_be) {
 		uint32_t x = idx->n;
@@ -323,67 +864,201 @@ void bam_index_save(const bam_index_t *idx, FILE *fp)
 	fflush(fp);
 }
 
+/* The index file is memory-mapped, or read into memory where mmap is not
+ * available, and only scanned for where each reference starts. The bins
+ * and the linear index of a reference are built on the first query
+ * touching it. The mapped pages come from the page cache and are thus
+ * shared by all processes reading the same index. */
+struct __index_lazy_t {
+	uint8_t *base;
+	size_t size;
+	int is_mmap;
+	uint64_t *off; // where the data of each reference start
+	uint8_t *loaded;
+	pthread_mutex_t lock;
+};
+
+static inline uint32_t lazy_u32(const uint8_t *p)
+{
+	uint32_t x;
+	memcpy(&x, p, 4);
+	if (bam_is_be) bam_swap_endian_4p(&x);
+	return x;
+}
+
+static inline uint64_t lazy_u64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, 8);
+	if (bam_is_be) bam_swap_endian_8p(&x);
+	return x;
+}
+
+// build the bins and the linear index of reference tid
+static void lazy_load_ref(bam_index_t *idx, int tid)
+{
+	const uint8_t *p = idx->lazy->base + idx->lazy->off[tid];
+	khash_t(i) *index;
+	bam_lidx_t *index2 = idx->index2 + tid;
+	uint32_t j, size;
+	int x, ret;
+	index = idx->index[tid] = kh_init(i);
+	size = lazy_u32(p); p += 4;
+	for (j = 0; j < size; ++j) {
+		bam_binlist_t *q;
+		khint_t k = kh_put(i, index, lazy_u32(p), &ret);
+		q = &kh_value(index, k);
+		p += 4;
+		q->loff = 0;
+		if (idx->is_csi) q->loff = lazy_u64(p), p += 8;
+		q->n = q->m = lazy_u32(p); p += 4;
+		q->list = (pair64_t*)malloc(q->m * 16);
+		memcpy(q->list, p, q->n * 16);
+		p += q->n * 16;
+		if (bam_is_be) {
+			for (x = 0; x < q->n; ++x) {
+				bam_swap_endian_8p(&q->list[x].u);
+				bam_swap_endian_8p(&q->list[x].v);
+			}
+		}
+	}
+	if (!idx->is_csi) {
+		index2->n = index2->m = lazy_u32(p); p += 4;
+		index2->offset = (uint64_t*)malloc(index2->m * 8);
+		memcpy(index2->offset, p, index2->n * 8);
+		if (bam_is_be)
+			for (x = 0; x < index2->n; ++x) bam_swap_endian_8p(&index2->offset[x]);
+	}
+	sort_bins_ref(idx, tid);
+}
+
+// make sure reference tid is loaded; safe to call from several threads
+static inline void index_touch(const bam_index_t *idx, int tid)
+{
+	index_lazy_t *l = idx->lazy;
+	if (l == 0) return;
+	pthread_mutex_lock(&l->lock);
+	if (!l->loaded[tid]) {
+		lazy_load_ref((bam_index_t*)idx, tid);
+		l->loaded[tid] = 1;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+static void lazy_destroy(index_lazy_t *l)
+{
+	if (l == 0) return;
+#ifdef BAM_INDEX_MMAP
+	if (l->is_mmap) munmap(l->base, l->size);
+	else free(l->base);
+#else
+	free(l->base);
+#endif
+	free(l->off); free(l->loaded);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+}
+
+// map or read the index file; return 0 on success
+static int lazy_open(index_lazy_t *l, FILE *fp)
+{
+	int64_t n;
+#ifdef BAM_INDEX_MMAP
+	struct stat st;
+	if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size == (size_t)st.st_size) {
+		void *base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+		if (base != MAP_FAILED) {
+			madvise(base, st.st_size, MADV_RANDOM);
+			l->base = (uint8_t*)base;
+			l->size = st.st_size;
+			l->is_mmap = 1;
+			return 0;
+		}
+	}
+#endif
+	l->size = 0;
+	n = 0x10000;
+	l->base = (uint8_t*)malloc(n);
+	while ((n = fread(l->base + l->size, 1, 0x10000, fp)) > 0) {
+		l->size += n;
+		l->base = (uint8_t*)realloc(l->base, l->size + 0x10000);
+	}
+	return 0;
+}
+
 static bam_index_t *bam_index_load_core(FILE *fp)
 {
 	int i;
-	char magic[4];
 	bam_index_t *idx;
+	index_lazy_t *l;
+	const uint8_t *p, *end;
 	if (fp == 0) {
 		fprintf(stderr, "[bam_index_load_core] fail to load index.\n");
 		return 0;
 	}
-	fread(magic, 1, 4, fp);
-	if (strncmp(magic, "BAI\1", 4)) {
+	l = (index_lazy_t*)calloc(1, sizeof(index_lazy_t));
+	pthread_mutex_init(&l->lock, 0);
+	lazy_open(l, fp);
+	p = l->base; end = l->base + l->size;
+	if (l->size < 8 || (memcmp(p, "BAI\1", 4) && memcmp(p, "CSI\1", 4))) {
 		fprintf(stderr, "[bam_index_load] wrong magic number.\n");
-		fclose(fp);
+		lazy_destroy(l);
 		return 0;
 	}
-	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));	
-	fread(&idx->n, 4, 1, fp);
-	if (bam_is_be) bam_swap_endian_4p(&idx->n);
+	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	if (p[0] == 'C') {
+		int32_t min_shift, n_lvls, l_aux;
+		if (l->size < 20) goto load_err;
+		min_shift = lazy_u32(p + 4); n_lvls = lazy_u32(p + 8); l_aux = lazy_u32(p + 12);
+		if (min_shift <= 0 || n_lvls < 0 || n_lvls > 9 || l_aux < 0) {
+			fprintf(stderr, "[bam_index_load] unsupported CSI parameters.\n");
+			lazy_destroy(l); free(idx);
+			return 0;
+		}
+		index_set_scheme(idx, min_shift, n_lvls);
+		p += 16 + l_aux; // skip the auxiliary data
+	} else {
+		index_set_scheme(idx, 0, 0);
+		p += 4;
+	}
+	if (end - p < 4) goto load_err;
+	idx->n = lazy_u32(p); p += 4;
+	if (idx->n < 0) goto load_err;
 	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
 	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
-	for (i = 0; i < idx->n; ++i) {
-		khash_t(i) *index;
-		bam_lidx_t *index2 = idx->index2 + i;
-		uint32_t key, size;
-		khint_t k;
-		int j, ret;
-		bam_binlist_t *p;
-		index = idx->index[i] = kh_init(i);
-		// load binning index
-		fread(&size, 4, 1, fp);
-		if (bam_is_be) bam_swap_endian_4p(&size);
-		for (j = 0; j < (int)size; ++j) {
-			fread(&key, 4, 1, fp);
-			if (bam_is_be) bam_swap_endian_4p(&key);
-			k = kh_put(i, index, key, &ret);
-			p = &kh_value(index, k);
-			fread(&p->n, 4, 1, fp);
-			if (bam_is_be) bam_swap_endian_4p(&p->n);
-			p->m = p->n;
-			p->list = (pair64_t*)malloc(p->m * 16);
-			fread(p->list, 16, p->n, fp);
-			if (bam_is_be) {
-				int x;
-				for (x = 0; x < p->n; ++x) {
-					bam_swap_endian_8p(&p->list[x].u);
-					bam_swap_endian_8p(&p->list[x].v);
-				}
-			}
+	idx->sorted = (bam_binvec_t*)calloc(idx->n, sizeof(bam_binvec_t));
+	idx->lazy = l;
+	l->off = (uint64_t*)malloc(idx->n * 8);
+	l->loaded = (uint8_t*)calloc(idx->n, 1);
+	for (i = 0; i < idx->n; ++i) { // only find where each reference starts, checking the sizes
+		uint32_t j, size;
+		l->off[i] = p - l->base;
+		if (end - p < 4) goto load_err;
+		size = lazy_u32(p); p += 4;
+		for (j = 0; j < size; ++j) {
+			uint32_t n_chunk;
+			p += idx->is_csi? 12 : 4;
+			if (end - p < 4) goto load_err;
+			n_chunk = lazy_u32(p); p += 4;
+			if ((uint64_t)(end - p) < (uint64_t)n_chunk * 16) goto load_err;
+			p += n_chunk * 16;
+		}
+		if (!idx->is_csi) {
+			uint32_t n_intv;
+			if (end - p < 4) goto load_err;
+			n_intv = lazy_u32(p); p += 4;
+			if ((uint64_t)(end - p) < (uint64_t)n_intv * 8) goto load_err;
+			p += n_intv * 8;
 		}
-		// load linear index
-		fread(&index2->n, 4, 1, fp);
-		if (bam_is_be) bam_swap_endian_4p(&index2->n);
-		index2->m = index2->n;
-		index2->offset = (uint64_t*)calloc(index2->m, 8);
-		fread(index2->offset, index2->n, 8, fp);
-		if (bam_is_be)
-			for (j = 0; j < index2->n; ++j) bam_swap_endian_8p(&index2->offset[j]);
 	}
-	if (fread(&idx->n_no_coor, 8, 1, fp) == 0) idx->n_no_coor = 0;
-	if (bam_is_be) bam_swap_endian_8p(&idx->n_no_coor);
+	idx->n_no_coor = end - p >= 8? lazy_u64(p) : 0;
 	return idx;
+
+load_err:
+	fprintf(stderr, "[bam_index_load] truncated or corrupted index.\n");
+	if (idx->lazy == 0) lazy_destroy(l);
+	bam_index_destroy(idx);
+	return 0;
 }
 
 bam_index_t *bam_index_load_local(const char *_fn)
@@ -409,6 +1084,10 @@ bam_index_t *bam_index_load_local(const char *_fn)
 			fp = fopen(fnidx, "rb");
 		}
 	}
+	if (fp == 0) { // try "{fn}.csi"
+		strcpy(fnidx, fn); strcat(fnidx, ".csi");
+		fp = fopen(fnidx, "rb");
+	}
 	free(fnidx); free(fn);
 	if (fp) {
 		bam_index_t *idx = bam_index_load_core(fp);
@@ -465,12 +1144,18 @@ bam_index_t *bam_index_load(const char *fn)
 		fprintf(stderr, "[bam_index_load] attempting to download the remote index file.\n");
 		download_from_remote(fnidx);
 		idx = bam_index_load_local(fn);
+		if (idx == 0) {
+			strcat(strcpy(fnidx, fn), ".csi");
+			download_from_remote(fnidx);
+			idx = bam_index_load_local(fn);
+		}
+		free(fnidx);
 	}
 	if (idx == 0) fprintf(stderr, "[bam_index_load] fail to load BAM index.\n");
 	return idx;
 }
 
-int bam_index_build2(const char *fn, const char *_fnidx)
+int bam_index_build4(const char *fn, const char *_fnidx, int n_threads, int min_shift, int n_lvls)
 {
 	char *fnidx;
 	FILE *fpidx;
@@ -480,15 +1165,20 @@ int bam_index_build2(const char *fn, const char *_fnidx)
 		fprintf(stderr, "[bam_index_build2] fail to open the BAM file.\n");
 		return -1;
 	}
-	idx = bam_index_core(fp);
-	bam_close(fp);
+	if (n_threads > 1) {
+		bam_close(fp);
+		idx = bam_index_core_mt(fn, n_threads, min_shift, n_lvls);
+	} else {
+		idx = bam_index_core2(fp, min_shift, n_lvls);
+		bam_close(fp);
+	}
 	if(idx == 0) {
 		fprintf(stderr, "[bam_index_build2] fail to index the BAM file.\n");
 		return -1;
 	}
 	if (_fnidx == 0) {
 		fnidx = (char*)calloc(strlen(fn) + 5, 1);
-		strcpy(fnidx, fn); strcat(fnidx, ".bai");
+		strcpy(fnidx, fn); strcat(fnidx, min_shift? ".csi" : ".bai");
 	} else fnidx = strdup(_fnidx);
 	fpidx = fopen(fnidx, "wb");
 	if (fpidx == 0) {
@@ -503,19 +1193,104 @@ int bam_index_build2(const char *fn, const char *_fnidx)
 	return 0;
 }
 
+int bam_index_build3(const char *fn, const char *_fnidx, int n_threads)
+{
+	return bam_index_build4(fn, _fnidx, n_threads, 0, 0);
+}
+
+int bam_index_build2(const char *fn, const char *_fnidx)
+{
+	return bam_index_build3(fn, _fnidx, 1);
+}
+
 int bam_index_build(const char *fn)
 {
 	return bam_index_build2(fn, 0);
 }
 
+// convert the positions returned by bgzf_utell() to virtual offsets
+static int index_utov(bam_index_t *idx, BGZF *fp)
+{
+	int i, j;
+	khint_t k;
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx->index[i];
+		bam_lidx_t *index2 = idx->index2 + i;
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			bam_binlist_t *p;
+			int n;
+			if (!kh_exist(index, k)) continue;
+			p = &kh_value(index, k);
+			n = kh_key(index, k) == idx->meta_bin? 1 : p->n; // the second pair of the meta bin holds counts
+			for (j = 0; j < n; ++j)
+				if ((int64_t)(p->list[j].u = bgzf_utov(fp, p->list[j].u)) < 0 || (int64_t)(p->list[j].v = bgzf_utov(fp, p->list[j].v)) < 0)
+					return -1;
+		}
+		for (j = 0; j < index2->n; ++j) // zero marks a missing entry
+			if (index2->offset[j] && (int64_t)(index2->offset[j] = bgzf_utov(fp, index2->offset[j])) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+int bam_index_otf_init(bamFile fp, int n_targets)
+{
+	if (fp->idx_build || bgzf_track_offsets(fp) != 0) return -1;
+	fp->idx_build = index_build_init(n_targets, bgzf_utell(fp), 0, 0);
+	return 0;
+}
+
+// called by bam_write1_core() after an alignment is written
+void bam_index_otf_push(bamFile fp, const bam1_core_t *c, uint8_t *data)
+{
+	index_build_push((index_build_t*)fp->idx_build, c, data, bgzf_utell(fp));
+}
+
+int bam_index_otf_save(bamFile fp, const char *fn)
+{
+	char *fnidx;
+	FILE *fpidx;
+	bam_index_t *idx;
+	if (fp->idx_build == 0) return -1;
+	idx = index_build_finish((index_build_t*)fp->idx_build);
+	fp->idx_build = 0;
+	if (idx == 0 || index_utov(idx, fp) < 0) {
+		fprintf(stderr, "[bam_index_otf_save] fail to index the BAM file.\n");
+		bam_index_destroy(idx);
+		return -1;
+	}
+	merge_chunks(idx);
+	fill_missing(idx);
+	fnidx = (char*)calloc(strlen(fn) + 5, 1);
+	strcpy(fnidx, fn); strcat(fnidx, ".bai");
+	fpidx = fopen(fnidx, "wb");
+	free(fnidx);
+	if (fpidx == 0) {
+		fprintf(stderr, "[bam_index_otf_save] fail to create the index file.\n");
+		bam_index_destroy(idx);
+		return -1;
+	}
+	bam_index_save(idx, fpidx);
+	bam_index_destroy(idx);
+	fclose(fpidx);
+	return 0;
+}
+
 int bam_index(int argc, char *argv[])
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: samtools index <in.bam> [out.index]\n");
+	int c, n_threads = 1, min_shift = 0;
+	while ((c = getopt(argc, argv, "@:cm:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		case 'c': if (min_shift == 0) min_shift = BAM_LIDX_SHIFT; break;
+		case 'm': min_shift = atoi(optarg); break;
+		}
+	}
+	if (optind + 1 > argc || min_shift < 0) {
+		fprintf(stderr, "Usage: samtools index [-c] [-m minShift] [-@ nThreads] <in.bam> [out.index]\n");
 		return 1;
 	}
-	if (argc >= 3) bam_index_build2(argv[1], argv[2]);
-	else bam_index_build(argv[1]);
+	bam_index_build4(argv[optind], optind + 1 < argc? argv[optind+1] : 0, n_threads, min_shift, 0);
 	return 0;
 }
 
@@ -537,9 +1312,11 @@ int bam_idxstats(int argc, char *argv[])
 	if (idx == 0) { fprintf(stderr, "[%s] fail to load the index.\n", __func__); return 1; }
 	for (i = 0; i < idx->n; ++i) {
 		khint_t k;
-		khash_t(i) *h = idx->index[i];
+		khash_t(i) *h;
+		index_touch(idx, i);
+		h = idx->index[i];
 		printf("%s\t%d", header->target_name[i], header->target_len[i]);
-		k = kh_get(i, h, BAM_MAX_BIN);
+		k = kh_get(i, h, idx->meta_bin);
 		if (k != kh_end(h))
 			printf("\t%llu\t%llu", (long long)kh_val(h, k).list[1].u, (long long)kh_val(h, k).list[1].v);
 		else printf("\t0\t0");
@@ -551,117 +1328,288 @@ int bam_idxstats(int argc, char *argv[])
 	return 0;
 }
 
-static inline int reg2bins(uint32_t beg, uint32_t end, uint16_t list[BAM_MAX_BIN])
+#define u64_lt(a, b) ((a) < (b))
+KSORT_INIT(u64, uint64_t, u64_lt)
+
+int64_t bam_index_no_coor_off(const bam_index_t *idx)
 {
-	int i = 0, k;
-	if (beg >= end) return 0;
-	if (end >= 1u<<29) end = 1u<<29;
-	--end;
-	list[i++] = 0;
-	for (k =    1 + (beg>>26); k <=    1 + (end>>26); ++k) list[i++] = k;
-	for (k =    9 + (beg>>23); k <=    9 + (end>>23); ++k) list[i++] = k;
-	for (k =   73 + (beg>>20); k <=   73 + (end>>20); ++k) list[i++] = k;
-	for (k =  585 + (beg>>17); k <=  585 + (end>>17); ++k) list[i++] = k;
-	for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
-	return i;
+	int i, j;
+	if (idx->n_no_coor == 0) return -1;
+	for (i = idx->n - 1; i >= 0; --i) { // they follow the last chunk of the last reference with alignments
+		khash_t(i) *h;
+		khint_t k;
+		uint64_t tail = 0;
+		index_touch(idx, i);
+		h = idx->index[i];
+		for (k = kh_begin(h); k != kh_end(h); ++k) {
+			bam_binlist_t *p;
+			if (!kh_exist(h, k) || kh_key(h, k) == idx->meta_bin) continue;
+			p = &kh_val(h, k);
+			for (j = 0; j < p->n; ++j)
+				if (p->list[j].v > tail) tail = p->list[j].v;
+		}
+		if (tail) return tail;
+	}
+	return 0;
 }
 
-static inline int is_overlap(uint32_t beg, uint32_t end, const bam1_t *b)
+uint64_t *bam_index_cut(const bam_index_t *idx, int64_t size, int n, int *n_parts)
 {
-	uint32_t rbeg = b->core.pos;
-	uint32_t rend = b->core.n_cigar? bam_calend(&b->core, bam1_cigar(b)) : b->core.pos + 1;
-	return (rend > beg && rbeg < end);
+	int i, j, n_cand = 0, m_cand = 0;
+	uint64_t *cand = 0, *cut, tail = 0;
+	int64_t beg;
+	*n_parts = 0;
+	for (i = 0; i < idx->n; ++i) { // every chunk starts at an alignment
+		khash_t(i) *h;
+		khint_t k;
+		index_touch(idx, i);
+		h = idx->index[i];
+		for (k = kh_begin(h); k != kh_end(h); ++k) {
+			bam_binlist_t *p;
+			if (!kh_exist(h, k) || kh_key(h, k) == idx->meta_bin) continue;
+			p = &kh_val(h, k);
+			for (j = 0; j < p->n; ++j) {
+				if (n_cand == m_cand) {
+					m_cand = m_cand? m_cand<<1 : 1024;
+					cand = (uint64_t*)realloc(cand, m_cand * 8);
+				}
+				cand[n_cand++] = p->list[j].u;
+				if (p->list[j].v > tail) tail = p->list[j].v;
+			}
+		}
+	}
+	if (n_cand == 0) {
+		free(cand);
+		return 0;
+	}
+	if (idx->n_no_coor) { // the unplaced reads follow the last chunk
+		if (n_cand == m_cand) cand = (uint64_t*)realloc(cand, ++m_cand * 8);
+		cand[n_cand++] = tail;
+	}
+	ks_introsort(u64, n_cand, cand);
+	cut = (uint64_t*)malloc(n * 8);
+	cut[(*n_parts)++] = cand[0];
+	beg = cand[0]>>16;
+	for (i = 1, j = 0; i < n; ++i) { // the first candidate at or after each even split of the compressed file
+		int64_t target = beg + (size - beg) * i / n;
+		while (j < n_cand && (int64_t)(cand[j]>>16) < target) ++j;
+		if (j == n_cand) break;
+		if (cand[j] > cut[*n_parts - 1]) cut[(*n_parts)++] = cand[j];
+	}
+	free(cand);
+	return cut;
 }
 
-struct __bam_iter_t {
-	int from_first; // read from the first record; no random access
-	int tid, beg, end, n_off, i, finished;
-	uint64_t curr_off;
-	pair64_t *off;
-};
+// the first position in the sorted bins of b at or after i with a bin number >= bin
+static inline int bins_lower_bound(const bam_binvec_t *b, int i, uint32_t bin)
+{
+	int j = b->n;
+	while (i < j) {
+		int m = i + ((j - i) >> 1);
+		if (b->a[m].bin < bin) i = m + 1;
+		else j = m;
+	}
+	return i;
+}
 
-// bam_fetch helper function retrieves 
-bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+// the smallest offset of the alignments overlapping pos, from the bins of a CSI index
+static uint64_t csi_min_off(const bam_index_t *idx, int tid, int64_t pos)
 {
-	uint16_t *bins;
-	int i, n_bins, n_off;
-	pair64_t *off;
-	khint_t k;
-	khash_t(i) *index;
-	uint64_t min_off;
-	bam_iter_t iter = 0;
+	const bam_binvec_t *b = &idx->sorted[tid];
+	int bin, i;
+	if (pos >= 1LL<<(idx->min_shift + idx->n_lvls * 3)) return 0;
+	bin = bin_first(idx->n_lvls) + (pos >> idx->min_shift);
+	for (;;) { // the nearest bin to the left at the same level, or the parent if the level has none
+		int first;
+		i = bins_lower_bound(b, 0, bin);
+		if (i < b->n && b->a[i].bin == bin) return b->a[i].p->loff;
+		if (bin == 0) return 0;
+		first = (((bin - 1) >> 3) << 3) + 1;
+		bin = bin > first? bin - 1 : (bin - 1) >> 3;
+	}
+}
 
-	if (beg < 0) beg = 0;
-	if (end < beg) return 0;
-	// initialize iter
-	iter = calloc(1, sizeof(struct __bam_iter_t));
-	iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
-	//
-	bins = (uint16_t*)calloc(BAM_MAX_BIN, 2);
-	n_bins = reg2bins(beg, end, bins);
-	index = idx->index[tid];
-	if (idx->index2[tid].n > 0) {
-		min_off = (beg>>BAM_LIDX_SHIFT >= idx->index2[tid].n)? idx->index2[tid].offset[idx->index2[tid].n-1]
-			: idx->index2[tid].offset[beg>>BAM_LIDX_SHIFT];
-		if (min_off == 0) { // improvement for index files built by tabix prior to 0.1.4
-			int n = beg>>BAM_LIDX_SHIFT;
-			if (n > idx->index2[tid].n) n = idx->index2[tid].n;
-			for (i = n - 1; i >= 0; --i)
-				if (idx->index2[tid].offset[i] != 0) break;
-			if (i >= 0) min_off = idx->index2[tid].offset[i];
-		}
-	} else min_off = 0; // tabix 0.1.2 may produce such index files
-	for (i = n_off = 0; i < n_bins; ++i) {
-		if ((k = kh_get(i, index, bins[i])) != kh_end(index))
-			n_off += kh_value(index, k).n;
+static uint64_t bai_min_off(const bam_index_t *idx, int tid, int beg)
+{
+	const bam_lidx_t *l = &idx->index2[tid];
+	uint64_t min_off;
+	int i;
+	if (l->n == 0) return 0; // tabix 0.1.2 may produce such index files
+	min_off = (beg>>BAM_LIDX_SHIFT >= l->n)? l->offset[l->n-1] : l->offset[beg>>BAM_LIDX_SHIFT];
+	if (min_off == 0) { // improvement for index files built by tabix prior to 0.1.4
+		int n = beg>>BAM_LIDX_SHIFT;
+		if (n > l->n) n = l->n;
+		for (i = n - 1; i >= 0; --i)
+			if (l->offset[i] != 0) break;
+		if (i >= 0) min_off = l->offset[i];
 	}
-	if (n_off == 0) {
-		free(bins); return iter;
+	return min_off;
+}
+
+/* Query planning appends the chunks of every region to a buffer kept per
+ * thread, so that a query only allocates the iterator and its result. */
+typedef struct {
+	int n, m;
+	pair64_t *a;
+} iter_scratch_t;
+
+static pthread_key_t iter_key;
+static pthread_once_t iter_once = PTHREAD_ONCE_INIT;
+
+static void iter_scratch_free(void *data)
+{
+	iter_scratch_t *s = (iter_scratch_t*)data;
+	free(s->a); free(s);
+}
+
+static void iter_key_init(void)
+{
+	pthread_key_create(&iter_key, iter_scratch_free);
+}
+
+static iter_scratch_t *iter_scratch(void)
+{
+	iter_scratch_t *s;
+	pthread_once(&iter_once, iter_key_init);
+	if ((s = (iter_scratch_t*)pthread_getspecific(iter_key)) == 0) {
+		s = (iter_scratch_t*)calloc(1, sizeof(iter_scratch_t));
+		pthread_setspecific(iter_key, s);
 	}
-	off = (pair64_t*)calloc(n_off, 16);
-	for (i = n_off = 0; i < n_bins; ++i) {
-		if ((k = kh_get(i, index, bins[i])) != kh_end(index)) {
+	s->n = 0;
+	return s;
+}
+
+/* Append the chunks of the bins overlapping [beg,end) that end after the
+ * linear index. The regions of a reference come sorted and next[l] is the
+ * first bin at level l not added yet, so that bins shared by neighbouring
+ * regions are added once; they were added with a smaller min_off. */
+static void iter_add_region(const bam_index_t *idx, int tid, int beg, int end, iter_scratch_t *s, int *next)
+{
+	const bam_binvec_t *b;
+	int64_t b0 = beg, e = end;
+	uint64_t min_off;
+	int i, l, t, sh = idx->min_shift + idx->n_lvls * 3;
+	index_touch(idx, tid);
+	b = &idx->sorted[tid];
+	if (e > 1LL<<sh) e = 1LL<<sh;
+	if (beg >= e) return;
+	--e;
+	min_off = idx->is_csi? csi_min_off(idx, tid, beg) : bai_min_off(idx, tid, beg);
+	// the bins of each level overlapping the region have consecutive numbers
+	for (l = 0, t = 0, i = 0; l <= idx->n_lvls; sh -= 3, t += 1<<((l<<1)+l), ++l) {
+		uint32_t hi = t + (e>>sh);
+		for (i = bins_lower_bound(b, i > next[l]? i : next[l], t + (b0>>sh)); i < b->n && b->a[i].bin <= hi; ++i) {
+			const bam_binlist_t *p = b->a[i].p;
 			int j;
-			bam_binlist_t *p = &kh_value(index, k);
+			if (s->n + p->n > s->m) {
+				s->m = s->n + p->n;
+				kroundup32(s->m);
+				s->a = (pair64_t*)realloc(s->a, s->m * 16);
+			}
 			for (j = 0; j < p->n; ++j)
-				if (p->list[j].v > min_off) off[n_off++] = p->list[j];
+				if (p->list[j].v > min_off) s->a[s->n++] = p->list[j];
 		}
+		next[l] = i;
 	}
-	free(bins);
-	if (n_off == 0) {
-		free(off); return iter;
-	}
-	{
-		bam1_t *b = (bam1_t*)calloc(1, sizeof(bam1_t));
-		int l;
-		ks_introsort(off, n_off, off);
-		// resolve completely contained adjacent blocks
-		for (i = 1, l = 0; i < n_off; ++i)
-			if (off[l].v < off[i].v)
-				off[++l] = off[i];
-		n_off = l + 1;
-		// resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-		for (i = 1; i < n_off; ++i)
-			if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-		{ // merge adjacent blocks
+}
+
+// sort the chunks, drop the duplicated and contained ones and merge those that are adjacent
+static int iter_merge_chunks(pair64_t *off, int n_off)
+{
+	int i, l;
+	if (n_off == 0) return 0;
+	ks_introsort(off, n_off, off);
+	// resolve completely contained adjacent blocks
+	for (i = 1, l = 0; i < n_off; ++i)
+		if (off[l].v < off[i].v)
+			off[++l] = off[i];
+	n_off = l + 1;
+	// resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+	for (i = 1; i < n_off; ++i)
+		if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+	{ // merge adjacent blocks
 #if defined(BAM_TRUE_OFFSET) || defined(BAM_VIRTUAL_OFFSET16)
-			for (i = 1, l = 0; i < n_off; ++i) {
+		for (i = 1, l = 0; i < n_off; ++i) {
 #ifdef BAM_TRUE_OFFSET
-				if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u) off[l].v = off[i].v;
+			if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u) off[l].v = off[i].v;
 #else
-				if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
-#endif
-				else off[++l] = off[i];
-			}
-			n_off = l + 1;
+			if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
 #endif
+			else off[++l] = off[i];
 		}
-		bam_destroy1(b);
+		n_off = l + 1;
+#endif
+	}
+	return n_off;
+}
+
+struct __bam_iter_t {
+	int from_first; // read from the first record; no random access
+	int n_off, i, finished;
+	int n_reg, i_reg; // regions sorted and not overlapping; those before i_reg are passed
+	bam_region_t *reg;
+	uint64_t curr_off;
+	pair64_t *off;
+};
+
+static bam_iter_t iter_plan(const bam_index_t *idx, bam_iter_t iter)
+{
+	iter_scratch_t *s = iter_scratch();
+	int i, next[10];
+	iter->i = -1;
+	for (i = 0; i < iter->n_reg; ++i) {
+		if (i == 0 || iter->reg[i].tid != iter->reg[i-1].tid) memset(next, 0, sizeof(next));
+		iter_add_region(idx, iter->reg[i].tid, iter->reg[i].beg, iter->reg[i].end, s, next);
+	}
+	if ((iter->n_off = iter_merge_chunks(s->a, s->n)) > 0) {
+		iter->off = (pair64_t*)malloc(iter->n_off * 16);
+		memcpy(iter->off, s->a, iter->n_off * 16);
 	}
-	iter->n_off = n_off; iter->off = off;
 	return iter;
 }
 
+// bam_fetch helper function retrieves 
+bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+{
+	bam_iter_t iter;
+	if (beg < 0) beg = 0;
+	if (end < beg) return 0;
+	iter = (bam_iter_t)calloc(1, sizeof(struct __bam_iter_t) + sizeof(bam_region_t));
+	iter->n_reg = 1;
+	iter->reg = (bam_region_t*)(iter + 1);
+	iter->reg->tid = tid, iter->reg->beg = beg, iter->reg->end = end;
+	return iter_plan(idx, iter);
+}
+
+#define region_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(reg, bam_region_t, region_lt)
+
+bam_iter_t bam_iter_query_many(const bam_index_t *idx, const bam_region_t *regs, int n)
+{
+	bam_iter_t iter;
+	bam_region_t *r;
+	int i, l;
+	iter = (bam_iter_t)calloc(1, sizeof(struct __bam_iter_t) + n * sizeof(bam_region_t));
+	r = iter->reg = (bam_region_t*)(iter + 1);
+	for (i = l = 0; i < n; ++i) { // drop empty regions and those on unknown references
+		if (regs[i].tid < 0 || regs[i].tid >= idx->n) continue;
+		r[l] = regs[i];
+		if (r[l].beg < 0) r[l].beg = 0;
+		if (r[l].end > r[l].beg) ++l;
+	}
+	if (l > 1) { // merge overlapping and adjacent regions
+		ks_introsort(reg, l, r);
+		for (i = 1, n = 0; i < l; ++i) {
+			if (r[i].tid == r[n].tid && r[i].beg <= r[n].end) {
+				if (r[n].end < r[i].end) r[n].end = r[i].end;
+			} else r[++n] = r[i];
+		}
+		l = n + 1;
+	}
+	iter->n_reg = l;
+	return iter_plan(idx, iter);
+}
+
 pair64_t *get_chunk_coordinates(const bam_index_t *idx, int tid, int beg, int end, int *cnt_off)
 { // for pysam compatibility
 	bam_iter_t iter;
@@ -677,6 +1625,22 @@ void bam_iter_destroy(bam_iter_t iter)
 	if (iter) { free(iter->off); free(iter); }
 }
 
+// 1 if b overlaps a region, 0 if not, or -1 if b is past the last region
+static inline int iter_overlap(bam_iter_t iter, const bam1_t *b)
+{
+	const bam_region_t *r;
+	uint32_t tid = b->core.tid, rend;
+	for (; iter->i_reg < iter->n_reg; ++iter->i_reg) { // alignments come sorted; skip the regions left behind
+		r = &iter->reg[iter->i_reg];
+		if ((uint32_t)r->tid > tid || (r->tid == tid && r->end > b->core.pos)) break;
+	}
+	if (iter->i_reg == iter->n_reg) return -1;
+	r = &iter->reg[iter->i_reg];
+	if (r->tid != tid) return 0;
+	rend = b->core.n_cigar? bam_calend(&b->core, bam1_cigar(b)) : b->core.pos + 1;
+	return (int)rend > r->beg;
+}
+
 int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 {
 	int ret;
@@ -688,6 +1652,7 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 	}
 	if (iter->off == 0) return -1;
 	for (;;) {
+		int o;
 		if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
 			if (iter->i == iter->n_off - 1) { ret = -1; break; } // no more chunks
 			if (iter->i >= 0) assert(iter->curr_off == iter->off[iter->i].v); // otherwise bug
@@ -699,11 +1664,11 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 		}
 		if ((ret = bam_read1(fp, b)) >= 0) {
 			iter->curr_off = bam_tell(fp);
-			if (b->core.tid != iter->tid || b->core.pos >= iter->end) { // no need to proceed
+			if ((o = iter_overlap(iter, b)) < 0) { // no need to proceed
 				ret = bam_validate1(NULL, b)? -1 : -5; // determine whether end of region or error
 				break;
 			}
-			else if (is_overlap(iter->beg, iter->end, b)) return ret;
+			else if (o) return ret;
 		} else break; // end of file or error
 	}
 	iter->finished = 1;
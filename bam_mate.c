@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "kstring.h"
 #include "bam.h"
 
@@ -94,12 +95,19 @@ void bam_mating_core(bamFile in, bamFile out)
 int bam_mating(int argc, char *argv[])
 {
 	bamFile in, out;
-	if (argc < 3) {
-		fprintf(stderr, "Usage: samtools fixmate <in.nameSrt.bam> <out.nameSrt.bam>\n");
+	int c, n_threads = 1;
+	while ((c = getopt(argc, argv, "@:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		}
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: samtools fixmate [-@ nThreads] <in.nameSrt.bam> <out.nameSrt.bam>\n");
 		return 1;
 	}
-	in = (strcmp(argv[1], "-") == 0)? bam_dopen(fileno(stdin), "r") : bam_open(argv[1], "r");
-    out = (strcmp(argv[2], "-") == 0)? bam_dopen(fileno(stdout), "w") : bam_open(argv[2], "w");
+	in = (strcmp(argv[optind], "-") == 0)? bam_dopen(fileno(stdin), "r") : bam_open(argv[optind], "r");
+    out = (strcmp(argv[optind+1], "-") == 0)? bam_dopen(fileno(stdout), "w") : bam_open(argv[optind+1], "w");
+	if (n_threads > 1) bgzf_mt(out, n_threads, 256);
 	bam_mating_core(in, out);
 	bam_close(in); bam_close(out);
 	return 0;
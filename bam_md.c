@@ -302,7 +302,7 @@ int bam_prob_realn(bam1_t *b, const char *ref)
 
 int bam_fillmd(int argc, char *argv[])
 {
-	int c, flt_flag, tid = -2, ret, len, is_bam_out, is_sam_in, is_uncompressed, max_nm, is_realn, capQ, baq_flag;
+	int c, flt_flag, tid = -2, ret, len, is_bam_out, is_sam_in, is_uncompressed, max_nm, is_realn, capQ, baq_flag, n_threads = 1;
 	samfile_t *fp, *fpout = 0;
 	faidx_t *fai;
 	char *ref = 0, mode_w[8], mode_r[8];
@@ -312,8 +312,9 @@ int bam_fillmd(int argc, char *argv[])
 	is_bam_out = is_sam_in = is_uncompressed = is_realn = max_nm = capQ = baq_flag = 0;
 	mode_w[0] = mode_r[0] = 0;
 	strcpy(mode_r, "r"); strcpy(mode_w, "w");
-	while ((c = getopt(argc, argv, "EqreuNhbSC:n:Ad")) >= 0) {
+	while ((c = getopt(argc, argv, "EqreuNhbSC:n:Ad@:")) >= 0) {
 		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
 		case 'r': is_realn = 1; break;
 		case 'e': flt_flag |= USE_EQUAL; break;
 		case 'd': flt_flag |= DROP_TAG; break;
@@ -343,7 +344,8 @@ int bam_fillmd(int argc, char *argv[])
 		fprintf(stderr, "         -S       the input is SAM with header\n");
 		fprintf(stderr, "         -A       modify the quality string\n");
 		fprintf(stderr, "         -r       compute the BQ tag (without -A) or cap baseQ by BAQ (with -A)\n");
-		fprintf(stderr, "         -E       extended BAQ for better sensitivity but lower specificity\n\n");
+		fprintf(stderr, "         -E       extended BAQ for better sensitivity but lower specificity\n");
+		fprintf(stderr, "         -@ INT   number of BAM compression threads (with -b) [1]\n\n");
 		return 1;
 	}
 	fp = samopen(argv[optind], mode_r, 0);
@@ -353,6 +355,7 @@ int bam_fillmd(int argc, char *argv[])
 		return 1;
 	}
 	fpout = samopen("-", mode_w, fp->header);
+	if (n_threads > 1) samthreads(fpout, n_threads, 256);
 	fai = fai_load(argv[optind+1]);
 
 	b = bam_init1();
@@ -0,0 +1,168 @@
+/* This program measures the multi-sample pileup on synthetic sparse inputs:
+ * each of n inputs has a few reads at random positions, so most columns are
+ * covered by few inputs. It runs bam_mplp_auto(), which keeps the inputs in
+ * a heap and here only clears the entries of the inputs it returned last,
+ * and a linear scan over all inputs as bam_mplp_auto() used to do, and
+ * reports columns per second.
+ * To compile, run `make mplpbench'.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "bam.h"
+
+#define READ_LEN 100
+
+typedef struct {
+	int n, i;
+	int32_t *pos; // sorted read positions
+	bam1_t *tpl; // the template read
+} aux_t;
+
+static int read_synth(void *data, bam1_t *b)
+{
+	aux_t *aux = (aux_t*)data;
+	if (aux->i == aux->n) return -1;
+	if (b->m_data < aux->tpl->data_len) {
+		b->m_data = aux->tpl->data_len;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+	}
+	b->core = aux->tpl->core;
+	b->data_len = aux->tpl->data_len, b->l_aux = 0;
+	memcpy(b->data, aux->tpl->data, b->data_len);
+	b->core.pos = aux->pos[aux->i++];
+	b->core.bin = bam_reg2bin(b->core.pos, b->core.pos + READ_LEN);
+	return 0;
+}
+
+static int cmp_int32(const void *a, const void *b)
+{
+	return *(int32_t*)a - *(int32_t*)b;
+}
+
+static double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static void aux_init(int n, aux_t *aux, int n_reads, int len, bam1_t *tpl)
+{
+	int i, j;
+	srand48(11);
+	for (i = 0; i < n; ++i) {
+		aux[i].n = n_reads, aux[i].i = 0, aux[i].tpl = tpl;
+		aux[i].pos = (int32_t*)malloc(n_reads * sizeof(int32_t));
+		for (j = 0; j < n_reads; ++j) aux[i].pos[j] = lrand48() % (len - READ_LEN);
+		qsort(aux[i].pos, n_reads, sizeof(int32_t), cmp_int32);
+	}
+}
+
+// bam_mplp_auto() before the heap: scan all inputs for the smallest position
+static uint64_t mplp_scan(int n, aux_t *aux, uint64_t *n_cov)
+{
+	int i, tid, pos, *n_plp, *cnt;
+	uint64_t *p, min = (uint64_t)-1, n_col = 0;
+	bam_plp_t *iter;
+	const bam_pileup1_t **plp;
+	iter = calloc(n, sizeof(void*));
+	p = calloc(n, 8); cnt = calloc(n, sizeof(int)); n_plp = calloc(n, sizeof(int));
+	plp = calloc(n, sizeof(void*));
+	for (i = 0; i < n; ++i) {
+		iter[i] = bam_plp_init(read_synth, &aux[i]);
+		p[i] = min;
+	}
+	for (;;) {
+		uint64_t new_min = (uint64_t)-1;
+		for (i = 0; i < n; ++i) {
+			if (p[i] == min) {
+				plp[i] = bam_plp_auto(iter[i], &tid, &pos, &cnt[i]);
+				p[i] = (uint64_t)tid<<32 | pos;
+			}
+			if (plp[i] && p[i] < new_min) new_min = p[i];
+		}
+		min = new_min;
+		if (new_min == (uint64_t)-1) break;
+		for (i = 0; i < n; ++i) {
+			if (plp[i] && p[i] == min) n_plp[i] = cnt[i], ++*n_cov;
+			else n_plp[i] = 0;
+		}
+		++n_col;
+	}
+	for (i = 0; i < n; ++i) bam_plp_destroy(iter[i]);
+	free(iter); free(p); free(cnt); free(n_plp); free(plp);
+	return n_col;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, n = 2000, n_reads = 50, len = 5000000, tid, pos;
+	int *n_plp;
+	uint64_t n_col[2], n_cov[2];
+	double t[2];
+	aux_t *aux;
+	bam1_t *tpl;
+	bam_mplp_t mplp;
+	const bam_pileup1_t **plp;
+	void **data;
+
+	while ((c = getopt(argc, argv, "n:r:l:")) >= 0) {
+		switch (c) {
+			case 'n': n = atoi(optarg); break;
+			case 'r': n_reads = atoi(optarg); break;
+			case 'l': len = atoi(optarg); break;
+		}
+	}
+	if (n <= 0 || n_reads <= 0 || len <= READ_LEN) {
+		fprintf(stderr, "Usage: mplpbench [-n nInputs] [-r nReadsPerInput] [-l refLen]\n");
+		return 1;
+	}
+	// a READ_LEN-bp mapped read named "r"
+	tpl = bam_init1();
+	tpl->core.tid = 0, tpl->core.qual = 60, tpl->core.l_qname = 2;
+	tpl->core.n_cigar = 1, tpl->core.l_qseq = READ_LEN;
+	tpl->core.mtid = -1, tpl->core.mpos = -1;
+	tpl->data_len = tpl->m_data = 2 + 4 + (READ_LEN + 1) / 2 + READ_LEN;
+	tpl->data = (uint8_t*)calloc(tpl->m_data, 1);
+	tpl->data[0] = 'r';
+	*bam1_cigar(tpl) = READ_LEN << BAM_CIGAR_SHIFT | BAM_CMATCH;
+	memset(bam1_seq(tpl), 0x12, (READ_LEN + 1) / 2);
+	memset(bam1_qual(tpl), 30, READ_LEN);
+	aux = (aux_t*)calloc(n, sizeof(aux_t));
+	data = calloc(n, sizeof(void*));
+	n_plp = calloc(n, sizeof(int));
+	plp = calloc(n, sizeof(void*));
+	// the heap
+	aux_init(n, aux, n_reads, len, tpl);
+	for (i = 0; i < n; ++i) data[i] = &aux[i];
+	n_col[0] = n_cov[0] = 0;
+	t[0] = realtime();
+	mplp = bam_mplp_init(n, read_synth, data);
+	bam_mplp_set_partial_clear(mplp, 1);
+	while ((c = bam_mplp_auto(mplp, &tid, &pos, n_plp, plp)) > 0)
+		n_cov[0] += c, ++n_col[0];
+	bam_mplp_destroy(mplp);
+	t[0] = realtime() - t[0];
+	// the linear scan
+	for (i = 0; i < n; ++i) free(aux[i].pos);
+	aux_init(n, aux, n_reads, len, tpl);
+	n_cov[1] = 0;
+	t[1] = realtime();
+	n_col[1] = mplp_scan(n, aux, &n_cov[1]);
+	t[1] = realtime() - t[1];
+	if (n_col[0] != n_col[1] || n_cov[0] != n_cov[1]) {
+		fprintf(stderr, "[%s] the two pileups disagree.\n", __func__);
+		return 1;
+	}
+	printf("inputs\t%d\ncolumns\t%llu\ninputs_per_column\t%.2f\n", n, (unsigned long long)n_col[0], (double)n_cov[0] / n_col[0]);
+	printf("heap\t%.3f sec\t%.0f columns/s\n", t[0], n_col[0] / t[0]);
+	printf("scan\t%.3f sec\t%.0f columns/s\n", t[1], n_col[1] / t[1]);
+	for (i = 0; i < n; ++i) free(aux[i].pos);
+	free(aux); free(data); free(n_plp); free(plp);
+	bam_destroy1(tpl);
+	return 0;
+}
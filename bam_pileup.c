@@ -6,9 +6,10 @@
 
 typedef struct {
 	int k, x, y, end;
+	int op, xe, is_m1;
 } cstate_t;
 
-static cstate_t g_cstate_null = { -1, 0, 0, 0 };
+static cstate_t g_cstate_null = { -1, 0, 0, 0, 0, 0, 0 };
 
 typedef struct __linkbuf_t {
 	bam1_t b;
@@ -60,85 +61,89 @@ static inline void mp_free(mempool_t *mp, lbnode_t *p)
 
 /* --- BEGIN: Auxiliary functions */
 
+#define _cop(c) ((c)&BAM_CIGAR_MASK)
+#define _cln(c) ((c)>>BAM_CIGAR_SHIFT)
+#define _is_match(op) ((op) == BAM_CMATCH || (op) == BAM_CEQUAL || (op) == BAM_CDIFF)
+
 /* s->k: the index of the CIGAR operator that has just been processed.
    s->x: the reference coordinate of the start of s->k
    s->y: the query coordiante of the start of s->k
+   s->op, s->xe: the operator s->k and the reference coordinate of its end
+   s->is_m1: the only operator other than clipping is a single M/=/X
  */
-static inline int resolve_cigar2(bam_pileup1_t *p, uint32_t pos, cstate_t *s)
+static void cstate_init(const bam1_t *b, cstate_t *s) // called when the read enters the pileup
 {
-#define _cop(c) ((c)&BAM_CIGAR_MASK)
-#define _cln(c) ((c)>>BAM_CIGAR_SHIFT)
+	const bam1_core_t *c = &b->core;
+	const uint32_t *cigar = bam1_cigar(b);
+	int k, n_m = 0, n_other = 0;
+	for (k = 0; k < c->n_cigar; ++k) {
+		int op = _cop(cigar[k]);
+		if (_is_match(op)) ++n_m;
+		else if (op != BAM_CSOFT_CLIP && op != BAM_CHARD_CLIP) ++n_other;
+	}
+	s->is_m1 = (n_m == 1 && n_other == 0);
+	for (k = 0, s->x = c->pos, s->y = 0; k < c->n_cigar; ++k) { // find the first match or deletion
+		int op = _cop(cigar[k]);
+		int l = _cln(cigar[k]);
+		if (_is_match(op) || op == BAM_CDEL) break;
+		else if (op == BAM_CREF_SKIP) s->x += l;
+		else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) s->y += l;
+	}
+	assert(k < c->n_cigar);
+	s->k = k;
+	s->op = _cop(cigar[k]); s->xe = s->x + _cln(cigar[k]);
+}
 
+static inline int resolve_cigar2(bam_pileup1_t *p, uint32_t pos, cstate_t *s)
+{
 	bam1_t *b = p->b;
 	bam1_core_t *c = &b->core;
 	uint32_t *cigar = bam1_cigar(b);
-	int k, is_head = 0;
+	int k;
+	if (s->k == -1) cstate_init(b, s); // never processed
+	p->is_del = p->indel = p->is_refskip = 0;
+	p->is_head = (pos == c->pos); p->is_tail = (pos == s->end);
+	if (s->is_m1) { // no indels or skips; nothing to peek at
+		p->qpos = s->y + (pos - s->x);
+		return 1;
+	}
 	// determine the current CIGAR operation
-//	fprintf(stderr, "%s\tpos=%d\tend=%d\t(%d,%d,%d)\n", bam1_qname(b), pos, s->end, s->k, s->x, s->y);
-	if (s->k == -1) { // never processed
-		is_head = 1;
-		if (c->n_cigar == 1) { // just one operation, save a loop
-		  if (_cop(cigar[0]) == BAM_CMATCH || _cop(cigar[0]) == BAM_CEQUAL || _cop(cigar[0]) == BAM_CDIFF) s->k = 0, s->x = c->pos, s->y = 0;
-		} else { // find the first match or deletion
-			for (k = 0, s->x = c->pos, s->y = 0; k < c->n_cigar; ++k) {
-				int op = _cop(cigar[k]);
-				int l = _cln(cigar[k]);
-				if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CEQUAL || op == BAM_CDIFF) break;
-				else if (op == BAM_CREF_SKIP) s->x += l;
-				else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) s->y += l;
-			}
-			assert(k < c->n_cigar);
-			s->k = k;
+	if ((int)pos >= s->xe) { // jump to the next operation
+		int op;
+		assert(s->k < c->n_cigar); // otherwise a bug: this function should not be called in this case
+		if (_is_match(s->op)) s->y += s->xe - s->x;
+		s->x = s->xe;
+		for (k = s->k + 1; k < c->n_cigar; ++k) { // find the next M/D/N/=/X
+			op = _cop(cigar[k]);
+			if (_is_match(op) || op == BAM_CDEL || op == BAM_CREF_SKIP) break;
+			else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) s->y += _cln(cigar[k]);
 		}
-	} else { // the read has been processed before
-		int op, l = _cln(cigar[s->k]);
-		if (pos - s->x >= l) { // jump to the next operation
-			assert(s->k < c->n_cigar); // otherwise a bug: this function should not be called in this case
-			op = _cop(cigar[s->k+1]);
-			if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP || op == BAM_CEQUAL || op == BAM_CDIFF) { // jump to the next without a loop
-			  if (_cop(cigar[s->k]) == BAM_CMATCH|| _cop(cigar[s->k]) == BAM_CEQUAL || _cop(cigar[s->k]) == BAM_CDIFF) s->y += l;
-				s->x += l;
-				++s->k;
-			} else { // find the next M/D/N/=/X
-			  if (_cop(cigar[s->k]) == BAM_CMATCH|| _cop(cigar[s->k]) == BAM_CEQUAL || _cop(cigar[s->k]) == BAM_CDIFF) s->y += l;
-				s->x += l;
-				for (k = s->k + 1; k < c->n_cigar; ++k) {
-					op = _cop(cigar[k]), l = _cln(cigar[k]);
-					if (op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP || op == BAM_CEQUAL || op == BAM_CDIFF) break;
-					else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) s->y += l;
-				}
-				s->k = k;
-			}
-			assert(s->k < c->n_cigar); // otherwise a bug
-		} // else, do nothing
-	}
-	{ // collect pileup information
-		int op, l;
-		op = _cop(cigar[s->k]); l = _cln(cigar[s->k]);
-		p->is_del = p->indel = p->is_refskip = 0;
-		if (s->x + l - 1 == pos && s->k + 1 < c->n_cigar) { // peek the next operation
-			int op2 = _cop(cigar[s->k+1]);
-			int l2 = _cln(cigar[s->k+1]);
-			if (op2 == BAM_CDEL) p->indel = -(int)l2;
-			else if (op2 == BAM_CINS) p->indel = l2;
-			else if (op2 == BAM_CPAD && s->k + 2 < c->n_cigar) { // no working for adjacent padding
-				int l3 = 0;
-				for (k = s->k + 2; k < c->n_cigar; ++k) {
-					op2 = _cop(cigar[k]); l2 = _cln(cigar[k]);
-					if (op2 == BAM_CINS) l3 += l2;
-					else if (op2 == BAM_CDEL || op2 == BAM_CMATCH || op2 == BAM_CREF_SKIP || op2 == BAM_CEQUAL || op2 == BAM_CDIFF) break;
-				}
-				if (l3 > 0) p->indel = l3;
+		assert(k < c->n_cigar); // otherwise a bug
+		s->k = k;
+		s->op = _cop(cigar[k]); s->xe = s->x + _cln(cigar[k]);
+	} // else, do nothing
+	// collect pileup information
+	if ((int)pos + 1 == s->xe && s->k + 1 < c->n_cigar) { // the end of the operation; peek the next one
+		int op2 = _cop(cigar[s->k+1]);
+		int l2 = _cln(cigar[s->k+1]);
+		if (op2 == BAM_CDEL) p->indel = -(int)l2;
+		else if (op2 == BAM_CINS) p->indel = l2;
+		else if (op2 == BAM_CPAD && s->k + 2 < c->n_cigar) { // no working for adjacent padding
+			int l3 = 0;
+			for (k = s->k + 2; k < c->n_cigar; ++k) {
+				op2 = _cop(cigar[k]); l2 = _cln(cigar[k]);
+				if (op2 == BAM_CINS) l3 += l2;
+				else if (op2 == BAM_CDEL || op2 == BAM_CMATCH || op2 == BAM_CREF_SKIP || op2 == BAM_CEQUAL || op2 == BAM_CDIFF) break;
 			}
+			if (l3 > 0) p->indel = l3;
 		}
-		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
-			p->qpos = s->y + (pos - s->x);
-		} else if (op == BAM_CDEL || op == BAM_CREF_SKIP) {
-			p->is_del = 1; p->qpos = s->y; // FIXME: distinguish D and N!!!!!
-			p->is_refskip = (op == BAM_CREF_SKIP);
-		} // cannot be other operations; otherwise a bug
-		p->is_head = (pos == c->pos); p->is_tail = (pos == s->end);
 	}
+	if (_is_match(s->op)) {
+		p->qpos = s->y + (pos - s->x);
+	} else if (s->op == BAM_CDEL || s->op == BAM_CREF_SKIP) {
+		p->is_del = 1; p->qpos = s->y; // FIXME: distinguish D and N!!!!!
+		p->is_refskip = (s->op == BAM_CREF_SKIP);
+	} // cannot be other operations; otherwise a bug
 	return 1;
 }
 
@@ -154,6 +159,7 @@ struct __bam_plp_t {
 	int32_t tid, pos, max_tid, max_pos;
 	int is_eof, flag_mask, max_plp, error, maxcnt;
 	bam_pileup1_t *plp;
+	uint64_t n_pos, n_rpos; // numbers of columns and of read positions returned
 	// for the "auto" interface only
 	bam1_t *b;
 	bam_plp_auto_f func;
@@ -229,7 +235,10 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 			iter->pos = iter->head->beg; // jump to the next position
 		} else ++iter->pos; // scan contiguously
 		// return
-		if (n_plp) return iter->plp;
+		if (n_plp) {
+			++iter->n_pos; iter->n_rpos += n_plp;
+			return iter->plp;
+		}
 		if (iter->is_eof && iter->head->next == 0) break;
 	}
 	return 0;
@@ -310,6 +319,11 @@ void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
 	iter->maxcnt = maxcnt;
 }
 
+void bam_plp_stat(const bam_plp_t iter, uint64_t *n_pos, uint64_t *n_rpos)
+{
+	*n_pos = iter->n_pos; *n_rpos = iter->n_rpos;
+}
+
 /*****************
  * callback APIs *
  *****************/
@@ -367,33 +381,119 @@ int bam_plbuf_push(const bam1_t *b, bam_plbuf_t *buf)
 	return 0;
 }
 
+/***************
+ * column view *
+ ***************/
+
+int bam_plp_col(bam_plp_col_t *col, int n, const bam_pileup1_t *plp)
+{
+	int i;
+	if (n > col->m) { // the arrays share one block
+		uint8_t *p;
+		col->m = n;
+		kroundup32(col->m);
+		p = realloc(col->qpos, (size_t)col->m * (2 * sizeof(int32_t) + 5));
+		col->qpos = (int32_t*)p; col->indel = col->qpos + col->m;
+		p += (size_t)col->m * 2 * sizeof(int32_t);
+		col->base4 = p; col->baseQ = p + col->m; col->mapQ = p + col->m * 2;
+		col->strand = p + col->m * 3; col->flag = p + col->m * 4;
+	}
+	for (i = 0; i < n; ++i) {
+		const bam_pileup1_t *p = plp + i;
+		const bam1_t *b = p->b;
+		col->qpos[i] = p->qpos;
+		col->indel[i] = p->indel;
+		if (p->is_del || p->is_refskip || p->qpos >= b->core.l_qseq) { // no read base here
+			col->base4[i] = 15, col->baseQ[i] = 0;
+		} else {
+			col->base4[i] = bam1_seqi(bam1_seq(b), p->qpos);
+			col->baseQ[i] = bam1_qual(b)[p->qpos];
+		}
+		col->mapQ[i] = b->core.qual;
+		col->strand[i] = bam1_strand(b)? 1 : 0;
+		col->flag[i] = p->is_del | p->is_refskip<<1 | p->is_head<<2 | p->is_tail<<3;
+	}
+	col->n = n;
+	return n;
+}
+
+void bam_plp_col_destroy(bam_plp_col_t *col)
+{
+	free(col->qpos);
+	memset(col, 0, sizeof(bam_plp_col_t));
+}
+
 /***********
  * mpileup *
  ***********/
 
+/* The inputs positioned after the current column are kept in a min-heap
+ * keyed by their next position, and those at the current column in a
+ * list, so that the work per column is proportional to the number of
+ * inputs covering it rather than to the total number of inputs. */
+typedef struct {
+	uint64_t pos;
+	int i;
+} mplp_heap1_t;
+
 struct __bam_mplp_t {
-	int n;
-	uint64_t min, *pos;
+	int n, n_heap, n_cur, n_out, partial;
+	mplp_heap1_t *heap;
+	int *cur, *out; // inputs at the current column; entries set in *out_plp
 	bam_plp_t *iter;
-	int *n_plp;
-	const bam_pileup1_t **plp;
+	int *n_plp, *out_n_plp;
+	const bam_pileup1_t **plp, **out_plp;
 };
 
+static inline int mplp_heap_lt(const mplp_heap1_t *a, const mplp_heap1_t *b)
+{
+	return a->pos < b->pos || (a->pos == b->pos && a->i < b->i);
+}
+
+static void mplp_heap_push(bam_mplp_t iter, uint64_t pos, int i)
+{
+	mplp_heap1_t *h = iter->heap, x;
+	int k = iter->n_heap++;
+	x.pos = pos, x.i = i;
+	while (k > 0 && mplp_heap_lt(&x, &h[(k-1)>>1])) { // sift up
+		h[k] = h[(k-1)>>1];
+		k = (k-1)>>1;
+	}
+	h[k] = x;
+}
+
+static void mplp_heap_pop(bam_mplp_t iter)
+{
+	mplp_heap1_t *h = iter->heap, x;
+	int k = 0, n = --iter->n_heap;
+	x = h[n];
+	while (k * 2 + 1 < n) { // sift down
+		int c = k * 2 + 1;
+		if (c + 1 < n && mplp_heap_lt(&h[c+1], &h[c])) ++c;
+		if (!mplp_heap_lt(&h[c], &x)) break;
+		h[k] = h[c];
+		k = c;
+	}
+	h[k] = x;
+}
+
 bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data)
 {
 	int i;
 	bam_mplp_t iter;
 	iter = calloc(1, sizeof(struct __bam_mplp_t));
-	iter->pos = calloc(n, 8);
+	iter->heap = calloc(n, sizeof(mplp_heap1_t));
+	iter->cur = calloc(n, sizeof(int));
+	iter->out = calloc(n, sizeof(int));
 	iter->n_plp = calloc(n, sizeof(int));
 	iter->plp = calloc(n, sizeof(void*));
 	iter->iter = calloc(n, sizeof(void*));
 	iter->n = n;
-	iter->min = (uint64_t)-1;
 	for (i = 0; i < n; ++i) {
 		iter->iter[i] = bam_plp_init(func, data[i]);
-		iter->pos[i] = iter->min;
+		iter->cur[i] = i; // all inputs are read on the first call
 	}
+	iter->n_cur = n;
 	return iter;
 }
 
@@ -404,34 +504,52 @@ void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt)
 		iter->iter[i]->maxcnt = maxcnt;
 }
 
+void bam_mplp_set_partial_clear(bam_mplp_t iter, int flag)
+{
+	iter->partial = flag;
+	iter->out_n_plp = 0, iter->out_plp = 0; // the next call clears all
+}
+
 void bam_mplp_destroy(bam_mplp_t iter)
 {
 	int i;
 	for (i = 0; i < iter->n; ++i) bam_plp_destroy(iter->iter[i]);
-	free(iter->iter); free(iter->pos); free(iter->n_plp); free(iter->plp);
+	free(iter->iter); free(iter->heap); free(iter->cur); free(iter->out);
+	free(iter->n_plp); free(iter->plp);
 	free(iter);
 }
 
 int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
 {
-	int i, ret = 0;
-	uint64_t new_min = (uint64_t)-1;
-	for (i = 0; i < iter->n; ++i) {
-		if (iter->pos[i] == iter->min) {
-			int tid, pos;
-			iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
-			iter->pos[i] = (uint64_t)tid<<32 | pos;
-		}
-		if (iter->plp[i] && iter->pos[i] < new_min) new_min = iter->pos[i];
+	int i, k;
+	uint64_t min;
+	// advance the inputs at the last column
+	for (k = 0; k < iter->n_cur; ++k) {
+		int tid, pos;
+		i = iter->cur[k];
+		iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
+		if (iter->plp[i]) mplp_heap_push(iter, (uint64_t)tid<<32 | pos, i);
+	}
+	iter->n_cur = 0;
+	if (iter->n_heap == 0) return 0;
+	min = iter->heap[0].pos;
+	*_tid = min>>32; *_pos = (uint32_t)min;
+	while (iter->n_heap > 0 && iter->heap[0].pos == min) {
+		iter->cur[iter->n_cur++] = iter->heap[0].i;
+		mplp_heap_pop(iter);
+	}
+	// with partial clear, only clear what the last call set, unless the caller's arrays changed
+	if (iter->partial && n_plp == iter->out_n_plp && plp == iter->out_plp) {
+		for (k = 0; k < iter->n_out; ++k)
+			n_plp[iter->out[k]] = 0, plp[iter->out[k]] = 0;
+	} else {
+		for (i = 0; i < iter->n; ++i) n_plp[i] = 0, plp[i] = 0;
+		iter->out_n_plp = n_plp, iter->out_plp = plp;
 	}
-	iter->min = new_min;
-	if (new_min == (uint64_t)-1) return 0;
-	*_tid = new_min>>32; *_pos = (uint32_t)new_min;
-	for (i = 0; i < iter->n; ++i) {
-		if (iter->pos[i] == iter->min) { // FIXME: valgrind reports "uninitialised value(s) at this line"
-			n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
-			++ret;
-		} else n_plp[i] = 0, plp[i] = 0;
+	for (k = 0; k < iter->n_cur; ++k) {
+		i = iter->out[k] = iter->cur[k];
+		n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
 	}
-	return ret;
+	iter->n_out = iter->n_cur;
+	return iter->n_cur;
 }
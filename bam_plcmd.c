@@ -4,31 +4,17 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "sam.h"
 #include "faidx.h"
 #include "kstring.h"
 
-static inline int printw(int c, FILE *fp)
-{
-	char buf[16];
-	int l, x;
-	if (c == 0) return fputc('0', fp);
-	for (l = 0, x = c < 0? -c : c; x > 0; x /= 10) buf[l++] = x%10 + '0';
-	if (c < 0) buf[l++] = '-';
-	buf[l] = 0;
-	for (x = 0; x < l/2; ++x) {
-		int y = buf[x]; buf[x] = buf[l-1-x]; buf[l-1-x] = y;
-	}
-	fputs(buf, fp);
-	return 0;
-}
-
-static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, const char *ref)
+static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, const char *ref, kstring_t *s)
 {
 	int j;
 	if (p->is_head) {
-		putchar('^');
-		putchar(p->b->core.qual > 93? 126 : p->b->core.qual + 33);
+		kputc('^', s);
+		kputc(p->b->core.qual > 93? 126 : p->b->core.qual + 33, s);
 	}
 	if (!p->is_del) {
 		int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(p->b), p->qpos)];
@@ -40,22 +26,22 @@ static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, cons
 			if (c == '=') c = bam1_strand(p->b)? ',' : '.';
 			else c = bam1_strand(p->b)? tolower(c) : toupper(c);
 		}
-		putchar(c);
-	} else putchar(p->is_refskip? (bam1_strand(p->b)? '<' : '>') : '*');
+		kputc(c, s);
+	} else kputc(p->is_refskip? (bam1_strand(p->b)? '<' : '>') : '*', s);
 	if (p->indel > 0) {
-		putchar('+'); printw(p->indel, stdout);
+		kputc('+', s); kputw(p->indel, s);
 		for (j = 1; j <= p->indel; ++j) {
 			int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(p->b), p->qpos + j)];
-			putchar(bam1_strand(p->b)? tolower(c) : toupper(c));
+			kputc(bam1_strand(p->b)? tolower(c) : toupper(c), s);
 		}
 	} else if (p->indel < 0) {
-		printw(p->indel, stdout);
+		kputw(p->indel, s);
 		for (j = 1; j <= -p->indel; ++j) {
 			int c = (ref && (int)pos+j < ref_len)? ref[pos+j] : 'N';
-			putchar(bam1_strand(p->b)? tolower(c) : toupper(c));
+			kputc(bam1_strand(p->b)? tolower(c) : toupper(c), s);
 		}
 	}
-	if (p->is_tail) putchar('$');
+	if (p->is_tail) kputc('$', s);
 }
 
 #include <assert.h>
@@ -81,11 +67,87 @@ typedef struct {
 	int max_mq, min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag;
 	int openQ, extQ, tandemQ, min_support; // for indels
 	double min_frac; // for indels
+	int n_threads;
 	char *reg, *pl_list;
 	faidx_t *fai;
 	void *bed, *rghash;
 } mplp_conf_t;
 
+/* A reference sequence is shared by the pileup and the threads while any
+ * of them uses it; sequences no longer used are freed when another one is
+ * fetched. */
+typedef struct {
+	int tid, len, n_use;
+	char *seq;
+} mplp_refseq_t;
+
+typedef struct {
+	faidx_t *fai;
+	const bam_header_t *h;
+	int n, m;
+	mplp_refseq_t *a;
+	pthread_mutex_t lock;
+} mplp_ref_t;
+
+static mplp_ref_t *mplp_ref_init(faidx_t *fai, const bam_header_t *h)
+{
+	mplp_ref_t *r = (mplp_ref_t*)calloc(1, sizeof(mplp_ref_t));
+	r->fai = fai, r->h = h;
+	pthread_mutex_init(&r->lock, 0);
+	return r;
+}
+
+static void mplp_ref_destroy(mplp_ref_t *r)
+{
+	int i;
+	for (i = 0; i < r->n; ++i) free(r->a[i].seq);
+	pthread_mutex_destroy(&r->lock);
+	free(r->a); free(r);
+}
+
+// get the sequence of tid and set *len to its length; NULL without a reference
+static char *mplp_ref_get(mplp_ref_t *r, int tid, int *len)
+{
+	int i, j;
+	char *seq;
+	*len = 0;
+	if (r->fai == 0 || tid < 0) return 0;
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->n; ++i)
+		if (r->a[i].tid == tid) break;
+	if (i == r->n) {
+		for (i = j = 0; i < r->n; ++i) { // free the unused sequences
+			if (r->a[i].n_use == 0) free(r->a[i].seq);
+			else r->a[j++] = r->a[i];
+		}
+		if (j == r->m) {
+			r->m = r->m? r->m<<1 : 4;
+			r->a = (mplp_refseq_t*)realloc(r->a, r->m * sizeof(mplp_refseq_t));
+		}
+		i = j, r->n = j + 1;
+		r->a[i].tid = tid, r->a[i].n_use = 0;
+		r->a[i].seq = faidx_fetch_seq(r->fai, r->h->target_name[tid], 0, 0x7fffffff, &r->a[i].len);
+		if (r->a[i].seq == 0) r->a[i].len = 0;
+	}
+	++r->a[i].n_use;
+	seq = r->a[i].seq, *len = r->a[i].len;
+	pthread_mutex_unlock(&r->lock);
+	return seq;
+}
+
+static void mplp_ref_put(mplp_ref_t *r, int tid)
+{
+	int i;
+	if (r->fai == 0 || tid < 0) return;
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->n; ++i)
+		if (r->a[i].tid == tid) {
+			--r->a[i].n_use;
+			break;
+		}
+	pthread_mutex_unlock(&r->lock);
+}
+
 typedef struct {
 	bamFile fp;
 	bam_iter_t iter;
@@ -145,7 +207,7 @@ static int mplp_func(void *data, bam1_t *b)
 	return ret;
 }
 
-static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
+static void group_smpl(mplp_pileup_t *m, const bam_sample_t *sm, kstring_t *buf,
 					   int n, char *const*fn, int *n_plp, const bam_pileup1_t **plp, int ignore_rg)
 {
 	int i, j;
@@ -172,31 +234,372 @@ static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
 	}
 }
 
+// read-only data for calling genotype likelihoods, shared by the threads
+typedef struct {
+	const mplp_conf_t *conf;
+	int n, max_indel_depth;
+	char **fn;
+	const bam_sample_t *sm;
+	void *rghash;
+	const bcf_hdr_t *bh;
+} mplp_glf_t;
+
+// per-thread buffers for calling genotype likelihoods
+typedef struct {
+	bcf_callaux_t *bca;
+	bcf_callret1_t *bcr;
+	bcf_call_t bc;
+	mplp_pileup_t gplp;
+	kstring_t buf;
+} mplp_caller_t;
+
+static mplp_caller_t *mplp_caller_init(const mplp_glf_t *g)
+{
+	const mplp_conf_t *conf = g->conf;
+	mplp_caller_t *c = (mplp_caller_t*)calloc(1, sizeof(mplp_caller_t));
+	c->gplp.n = g->sm->n;
+	c->gplp.n_plp = calloc(g->sm->n, sizeof(int));
+	c->gplp.m_plp = calloc(g->sm->n, sizeof(int));
+	c->gplp.plp = calloc(g->sm->n, sizeof(void*));
+	c->bca = bcf_call_init(-1., conf->min_baseQ);
+	c->bcr = calloc(g->sm->n, sizeof(bcf_callret1_t));
+	c->bca->rghash = g->rghash;
+	c->bca->openQ = conf->openQ, c->bca->extQ = conf->extQ, c->bca->tandemQ = conf->tandemQ;
+	c->bca->min_frac = conf->min_frac;
+	c->bca->min_support = conf->min_support;
+	return c;
+}
+
+static void mplp_caller_destroy(mplp_caller_t *c)
+{
+	int i;
+	for (i = 0; i < c->gplp.n; ++i) free(c->gplp.plp[i]);
+	free(c->gplp.plp); free(c->gplp.n_plp); free(c->gplp.m_plp);
+	bcf_call_destroy(c->bca); free(c->bc.PL); free(c->bcr);
+	free(c->buf.s); free(c);
+}
+
+// write a record with bcf_write(), or append it to str in the same layout
+static void mplp_write(bcf_t *bp, kstring_t *str, const bcf_hdr_t *h, const bcf1_t *b)
+{
+	int i;
+	if (str == 0) {
+		bcf_write(bp, h, b);
+		return;
+	}
+	kputsn((char*)&b->tid, 4, str);
+	kputsn((char*)&b->pos, 4, str);
+	kputsn((char*)&b->qual, 4, str);
+	kputsn((char*)&b->l_str, 4, str);
+	kputsn(b->str, b->l_str, str);
+	for (i = 0; i < b->n_gi; ++i)
+		kputsn((char*)b->gi[i].data, b->gi[i].len * h->n_smpl, str);
+}
+
+// call the genotype likelihoods of SNPs and indels at a column
+static void mplp_call(const mplp_glf_t *g, mplp_caller_t *c, int tid, int pos, int *n_plp, const bam_pileup1_t **plp,
+					  const char *ref, int ref_len, bcf_t *bp, kstring_t *str)
+{
+	const mplp_conf_t *conf = g->conf;
+	int i, total_depth, _ref0, ref16;
+	bcf1_t *b = calloc(1, sizeof(bcf1_t));
+	for (i = total_depth = 0; i < g->n; ++i) total_depth += n_plp[i];
+	group_smpl(&c->gplp, g->sm, &c->buf, g->n, g->fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
+	_ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
+	ref16 = bam_nt16_table[_ref0];
+	for (i = 0; i < c->gplp.n; ++i)
+		bcf_call_glfgen(c->gplp.n_plp[i], c->gplp.plp[i], ref16, c->bca, c->bcr + i);
+	bcf_call_combine(c->gplp.n, c->bcr, ref16, &c->bc);
+	bcf_call2bcf(tid, pos, &c->bc, b, c->bcr, conf->fmt_flag, 0, 0);
+	mplp_write(bp, str, g->bh, b);
+	bcf_destroy(b);
+	// call indels
+	if (!(conf->flag&MPLP_NO_INDEL) && total_depth < g->max_indel_depth && bcf_call_gap_prep(c->gplp.n, c->gplp.n_plp, c->gplp.plp, pos, c->bca, ref, g->rghash) >= 0) {
+		for (i = 0; i < c->gplp.n; ++i)
+			bcf_call_glfgen(c->gplp.n_plp[i], c->gplp.plp[i], -1, c->bca, c->bcr + i);
+		if (bcf_call_combine(c->gplp.n, c->bcr, -1, &c->bc) >= 0) {
+			b = calloc(1, sizeof(bcf1_t));
+			bcf_call2bcf(tid, pos, &c->bc, b, c->bcr, conf->fmt_flag, c->bca, ref);
+			mplp_write(bp, str, g->bh, b);
+			bcf_destroy(b);
+		}
+	}
+}
+
+#define MPLP_OUT_BLOCK 0x10000 // text output is written in blocks of this size
+
+// format a column of the text pileup
+static void mplp_print(const mplp_conf_t *conf, const char *name, int n, int pos, int *n_plp, const bam_pileup1_t **plp,
+					   const char *ref, int ref_len, kstring_t *s)
+{
+	int i, j;
+	kputs(name, s); kputc('\t', s);
+	kputw(pos + 1, s); kputc('\t', s);
+	kputc((ref && pos < ref_len)? ref[pos] : 'N', s);
+	for (i = 0; i < n; ++i) {
+		int cnt;
+		char *q;
+		for (j = cnt = 0; j < n_plp[i]; ++j) {
+			const bam_pileup1_t *p = plp[i] + j;
+			if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ) ++cnt;
+		}
+		kputc('\t', s); kputw(cnt, s); kputc('\t', s);
+		if (n_plp[i] == 0) {
+			kputsn("*\t*", 3, s);
+			if (conf->flag & MPLP_PRINT_POS) kputsn("\t*", 2, s);
+			continue;
+		}
+		for (j = 0; j < n_plp[i]; ++j) {
+			const bam_pileup1_t *p = plp[i] + j;
+			if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
+				pileup_seq(p, pos, ref_len, ref, s);
+		}
+		// the quality strings have known lengths; fill them in place
+		ks_resize(s, s->l + 2 * n_plp[i] + 3);
+		q = s->s + s->l;
+		*q++ = '\t';
+		for (j = 0; j < n_plp[i]; ++j) {
+			const bam_pileup1_t *p = plp[i] + j;
+			int c = bam1_qual(p->b)[p->qpos];
+			if (c >= conf->min_baseQ) *q++ = c + 33 < 126? c + 33 : 126;
+		}
+		if (conf->flag & MPLP_PRINT_MAPQ) {
+			*q++ = '\t';
+			for (j = 0; j < n_plp[i]; ++j) {
+				int c = plp[i][j].b->core.qual + 33;
+				*q++ = c < 126? c : 126;
+			}
+		}
+		*q = 0;
+		s->l = q - s->s;
+		if (conf->flag & MPLP_PRINT_POS) {
+			kputc('\t', s);
+			for (j = 0; j < n_plp[i]; ++j) {
+				if (j > 0) kputc(',', s);
+				kputw(plp[i][j].qpos + 1, s);
+			}
+		}
+	}
+	kputc('\n', s);
+}
+
+/* With -@, BCF output is computed in shards of MPLP_SHARD_LEN columns.
+ * Each thread has its own handles on the input files and retrieves the
+ * reads of a shard from MPLP_SHARD_PAD before its first column, so that
+ * the reads spanning the boundary and those limited by the depth cap
+ * ahead of it are seen as in a single pass. The records of a shard are
+ * kept in memory and written in the genomic order by the main thread,
+ * which makes the output identical to that of a single thread.
+ *
+ * A single thread sets the reference of a chromosome at its first column
+ * passing the filters; reads read before that are not realigned. A shard
+ * switches at column sw, or before reading if sw<0. The workers guess sw
+ * and the main thread calls a shard again when the guess was wrong. */
+#define MPLP_SHARD_LEN 1000000
+#define MPLP_SHARD_PAD 1000
+
+typedef struct {
+	int tid, beg, end, done;
+	int sw, first; // the column the reference is set at; the first column called or -1
+	kstring_t str;
+} mplp_shard_t;
+
+typedef struct {
+	mplp_glf_t g;
+	const bam_header_t *h;
+	bam_index_t **idx;
+	mplp_ref_t *refs;
+	int max_depth;
+	int n_shards, next, n_written, max_ahead;
+	mplp_shard_t *shards;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_done, cv_free;
+} mplp_mt_t;
+
+static void mplp_shard(mplp_mt_t *m, mplp_shard_t *s, mplp_aux_t **aux, mplp_caller_t *c, int *n_plp, const bam_pileup1_t **plp)
+{
+	const mplp_conf_t *conf = m->g.conf;
+	int i, tid, pos, ref_len, beg = s->beg > MPLP_SHARD_PAD? s->beg - MPLP_SHARD_PAD : 0;
+	char *ref;
+	bam_mplp_t iter;
+	ref = mplp_ref_get(m->refs, s->tid, &ref_len);
+	for (i = 0; i < m->g.n; ++i) {
+		aux[i]->iter = bam_iter_query(m->idx[i], s->tid, beg, s->end);
+		aux[i]->ref = s->sw < 0? ref : 0, aux[i]->ref_id = s->sw < 0? s->tid : -1;
+	}
+	s->str.l = 0, s->first = -1;
+	iter = bam_mplp_init(m->g.n, mplp_func, (void**)aux);
+	bam_mplp_set_maxcnt(iter, m->max_depth);
+	while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
+		int pass;
+		if (pos >= s->end) break;
+		pass = !conf->bed || bed_overlap(conf->bed, m->h->target_name[tid], pos, pos+1);
+		if (pass && pos >= s->sw && aux[0]->ref_id < 0)
+			for (i = 0; i < m->g.n; ++i) aux[i]->ref = ref, aux[i]->ref_id = tid;
+		if (!pass || pos < s->beg) continue;
+		if (s->first < 0) s->first = pos;
+		mplp_call(&m->g, c, tid, pos, n_plp, plp, ref, ref_len, 0, &s->str);
+	}
+	bam_mplp_destroy(iter);
+	mplp_ref_put(m->refs, s->tid);
+	for (i = 0; i < m->g.n; ++i) {
+		bam_iter_destroy(aux[i]->iter);
+		aux[i]->iter = 0, aux[i]->ref = 0, aux[i]->ref_id = -1;
+	}
+}
+
+// per-thread handles on the inputs and buffers for calling shards
+typedef struct {
+	mplp_mt_t *m;
+	mplp_aux_t **aux;
+	int *n_plp;
+	const bam_pileup1_t **plp;
+	mplp_caller_t *c;
+} mplp_thread_t;
+
+static void mplp_thread_destroy(mplp_thread_t *t)
+{
+	int i;
+	for (i = 0; i < t->m->g.n && t->aux[i]; ++i) {
+		if (t->aux[i]->fp) bam_close(t->aux[i]->fp);
+		free(t->aux[i]);
+	}
+	if (t->c) mplp_caller_destroy(t->c);
+	free(t->aux); free(t->plp); free(t->n_plp); free(t);
+}
+
+// open the inputs for a thread; NULL if any of them fails to open
+static mplp_thread_t *mplp_thread_init(mplp_mt_t *m)
+{
+	int i, n = m->g.n;
+	mplp_thread_t *t = (mplp_thread_t*)calloc(1, sizeof(mplp_thread_t));
+	t->m = m;
+	t->aux = calloc(n, sizeof(void*));
+	t->plp = calloc(n, sizeof(void*));
+	t->n_plp = calloc(n, sizeof(int));
+	for (i = 0; i < n; ++i) {
+		t->aux[i] = calloc(1, sizeof(mplp_aux_t));
+		t->aux[i]->h = (bam_header_t*)m->h, t->aux[i]->conf = m->g.conf;
+		t->aux[i]->ref_id = -1;
+		if ((t->aux[i]->fp = bam_open(m->g.fn[i], "r")) == 0) {
+			fprintf(stderr, "[%s] fail to open %d-th input.\n", __func__, i+1);
+			mplp_thread_destroy(t);
+			return 0;
+		}
+	}
+	t->c = mplp_caller_init(&m->g);
+	return t;
+}
+
+static void *mplp_worker(void *data)
+{
+	mplp_thread_t *t = (mplp_thread_t*)data;
+	mplp_mt_t *m = t->m;
+	for (;;) {
+		mplp_shard_t *s;
+		pthread_mutex_lock(&m->lock);
+		while (m->next < m->n_shards && m->next >= m->n_written + m->max_ahead)
+			pthread_cond_wait(&m->cv_free, &m->lock);
+		s = m->next < m->n_shards? &m->shards[m->next++] : 0;
+		pthread_mutex_unlock(&m->lock);
+		if (s == 0) break;
+		mplp_shard(m, s, t->aux, t->c, t->n_plp, t->plp);
+		pthread_mutex_lock(&m->lock);
+		s->done = 1;
+		pthread_cond_broadcast(&m->cv_done);
+		pthread_mutex_unlock(&m->lock);
+	}
+	return 0;
+}
+
+/* Call the columns from beg to end on tid, or from 0 to end on all
+ * references if tid<0, on conf->n_threads threads. Return -1 without
+ * calling anything if the inputs cannot be opened for every thread. */
+static int mplp_call_mt(mplp_mt_t *m, bcf_t *bp, int tid, int beg, int end)
+{
+	int i, n_threads = m->g.conf->n_threads, sw_tid = -1, sw = -1;
+	pthread_t *tid_t;
+	mplp_thread_t **t;
+	t = (mplp_thread_t**)calloc(n_threads + 1, sizeof(void*));
+	for (i = 0; i <= n_threads; ++i) // open all the handles before any output; the last is for the main thread
+		if ((t[i] = mplp_thread_init(m)) == 0) break;
+	if (i <= n_threads) {
+		while (i > 0) mplp_thread_destroy(t[--i]);
+		free(t);
+		return -1;
+	}
+	m->n_shards = 0;
+	for (i = tid < 0? 0 : tid; i < m->h->n_targets && (tid < 0 || i == tid); ++i) {
+		int b = tid < 0? 0 : beg, e = end > m->h->target_len[i]? m->h->target_len[i] : end;
+		do { // the last shard runs to end, as reads may overhang the reference
+			mplp_shard_t *s;
+			if ((m->n_shards & 0xff) == 0)
+				m->shards = (mplp_shard_t*)realloc(m->shards, (m->n_shards + 0x100) * sizeof(mplp_shard_t));
+			s = &m->shards[m->n_shards++];
+			memset(s, 0, sizeof(mplp_shard_t));
+			s->tid = i, s->beg = b, s->end = e - b > MPLP_SHARD_LEN? b + MPLP_SHARD_LEN : end;
+			s->sw = !m->g.conf->reg && b == 0? 0 : -1; // guess the reference is set before this shard
+			b = s->end;
+		} while (b < e);
+	}
+	m->next = m->n_written = 0, m->max_ahead = n_threads * 8;
+	pthread_mutex_init(&m->lock, 0);
+	pthread_cond_init(&m->cv_done, 0);
+	pthread_cond_init(&m->cv_free, 0);
+	tid_t = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_threads; ++i) pthread_create(&tid_t[i], 0, mplp_worker, t[i]);
+	for (i = 0; i < m->n_shards; ++i) {
+		mplp_shard_t *s = &m->shards[i];
+		pthread_mutex_lock(&m->lock);
+		while (!s->done) pthread_cond_wait(&m->cv_done, &m->lock);
+		pthread_mutex_unlock(&m->lock);
+		if (!m->g.conf->reg) { // where a single thread sets the reference
+			int sw1 = s->beg;
+			if (s->tid == sw_tid) sw1 = sw < s->beg - MPLP_SHARD_PAD? -1 : sw;
+			if (sw1 != s->sw) {
+				s->sw = sw1;
+				mplp_shard(m, s, t[n_threads]->aux, t[n_threads]->c, t[n_threads]->n_plp, t[n_threads]->plp);
+			}
+			if (s->first >= 0 && s->tid != sw_tid) sw_tid = s->tid, sw = s->first;
+		}
+		if (s->str.l) bgzf_write(bp->fp, s->str.s, s->str.l);
+		free(s->str.s);
+		pthread_mutex_lock(&m->lock);
+		++m->n_written;
+		pthread_cond_broadcast(&m->cv_free);
+		pthread_mutex_unlock(&m->lock);
+	}
+	for (i = 0; i < n_threads; ++i) pthread_join(tid_t[i], 0);
+	for (i = 0; i <= n_threads; ++i) mplp_thread_destroy(t[i]);
+	free(tid_t); free(t);
+	pthread_cond_destroy(&m->cv_free);
+	pthread_cond_destroy(&m->cv_done);
+	pthread_mutex_destroy(&m->lock);
+	free(m->shards);
+	return 0;
+}
+
 static int mpileup(mplp_conf_t *conf, int n, char **fn)
 {
 	extern void *bcf_call_add_rg(void *rghash, const char *hdtext, const char *list);
 	extern void bcf_call_del_rghash(void *rghash);
 	mplp_aux_t **data;
-	int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 1u<<29, ref_len, ref_tid = -1, max_depth, max_indel_depth;
+	int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 0x7fffffff, ref_len = 0, ref_tid = -1, max_depth, max_indel_depth;
 	const bam_pileup1_t **plp;
 	bam_mplp_t iter;
 	bam_header_t *h = 0;
-	char *ref;
+	bam_index_t **idx = 0;
+	char *ref = 0;
 	void *rghash = 0;
-
-	bcf_callaux_t *bca = 0;
-	bcf_callret1_t *bcr = 0;
-	bcf_call_t bc;
+	mplp_ref_t *refs;
+	mplp_glf_t g;
+	mplp_caller_t *caller = 0;
 	bcf_t *bp = 0;
 	bcf_hdr_t *bh = 0;
-
 	bam_sample_t *sm = 0;
-	kstring_t buf;
-	mplp_pileup_t gplp;
+	kstring_t out;
 
-	memset(&gplp, 0, sizeof(mplp_pileup_t));
-	memset(&buf, 0, sizeof(kstring_t));
-	memset(&bc, 0, sizeof(bcf_call_t));
+	out.l = out.m = 0; out.s = 0;
 	data = calloc(n, sizeof(void*));
 	plp = calloc(n, sizeof(void*));
 	n_plp = calloc(n, sizeof(int*));
@@ -208,6 +611,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		data[i] = calloc(1, sizeof(mplp_aux_t));
 		data[i]->fp = strcmp(fn[i], "-") == 0? bam_dopen(fileno(stdin), "r") : bam_open(fn[i], "r");
 		data[i]->conf = conf;
+		data[i]->ref_id = -1;
 		h_tmp = bam_header_read(data[i]->fp);
 		data[i]->h = i? h : h_tmp; // for i==0, "h" has not been set yet
 		bam_smpl_add(sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : h_tmp->text);
@@ -234,12 +638,17 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 			bam_header_destroy(h_tmp);
 		}
 	}
-	gplp.n = sm->n;
-	gplp.n_plp = calloc(sm->n, sizeof(int));
-	gplp.m_plp = calloc(sm->n, sizeof(int));
-	gplp.plp = calloc(sm->n, sizeof(void*));
+	refs = mplp_ref_init(conf->fai, h);
 
 	fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, sm->n, n);
+	max_depth = conf->max_depth;
+	if (max_depth * sm->n > 1<<20)
+		fprintf(stderr, "(%s) Max depth is above 1M. Potential memory hog!\n", __func__);
+	if (max_depth * sm->n < 8000) {
+		max_depth = 8000 / sm->n;
+		fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, max_depth);
+	}
+	max_indel_depth = conf->max_indel_depth * sm->n;
 	// write the VCF header
 	if (conf->flag & MPLP_GLF) {
 		kstring_t s;
@@ -265,123 +674,78 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		free(s.s);
 		bcf_hdr_sync(bh);
 		bcf_hdr_write(bp, bh);
-		bca = bcf_call_init(-1., conf->min_baseQ);
-		bcr = calloc(sm->n, sizeof(bcf_callret1_t));
-		bca->rghash = rghash;
-		bca->openQ = conf->openQ, bca->extQ = conf->extQ, bca->tandemQ = conf->tandemQ;
-		bca->min_frac = conf->min_frac;
-		bca->min_support = conf->min_support;
+		g.conf = conf, g.n = n, g.max_indel_depth = max_indel_depth;
+		g.fn = fn, g.sm = sm, g.rghash = rghash, g.bh = bh;
+		if (conf->n_threads > 1) { // shards need the indices of all inputs
+			idx = calloc(n, sizeof(void*));
+			for (i = 0; i < n; ++i)
+				if (strcmp(fn[i], "-") == 0 || (idx[i] = bam_index_load(fn[i])) == 0) break;
+			if (i < n) {
+				fprintf(stderr, "[%s] the %d-th input is not indexed; calling on one thread.\n", __func__, i+1);
+				for (i = 0; i < n; ++i)
+					if (idx[i]) bam_index_destroy(idx[i]);
+				free(idx); idx = 0;
+			}
+		}
+		caller = mplp_caller_init(&g);
 	}
-	if (tid0 >= 0 && conf->fai) { // region is set
-		ref = faidx_fetch_seq(conf->fai, h->target_name[tid0], 0, 0x7fffffff, &ref_len);
+	if (idx) {
+		mplp_mt_t m;
+		int ret;
+		memset(&m, 0, sizeof(mplp_mt_t));
+		m.g = g, m.h = h, m.idx = idx, m.refs = refs, m.max_depth = max_depth;
+		if ((ret = mplp_call_mt(&m, bp, tid0, beg0, end0)) < 0)
+			fprintf(stderr, "[%s] calling on one thread.\n", __func__);
+		for (i = 0; i < n; ++i) bam_index_destroy(idx[i]);
+		free(idx);
+		if (ret == 0) goto mplp_end;
+	}
+	if (tid0 >= 0) { // region is set
+		ref = mplp_ref_get(refs, tid0, &ref_len);
 		ref_tid = tid0;
 		for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid0;
-	} else ref_tid = -1, ref = 0;
-	iter = bam_mplp_init(n, mplp_func, (void**)data);
-	max_depth = conf->max_depth;
-	if (max_depth * sm->n > 1<<20)
-		fprintf(stderr, "(%s) Max depth is above 1M. Potential memory hog!\n", __func__);
-	if (max_depth * sm->n < 8000) {
-		max_depth = 8000 / sm->n;
-		fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, max_depth);
 	}
-	max_indel_depth = conf->max_indel_depth * sm->n;
+	iter = bam_mplp_init(n, mplp_func, (void**)data);
 	bam_mplp_set_maxcnt(iter, max_depth);
 	while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
 		if (conf->reg && (pos < beg0 || pos >= end0)) continue; // out of the region requested
 		if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
 		if (tid != ref_tid) {
-			free(ref); ref = 0;
-			if (conf->fai) ref = faidx_fetch_seq(conf->fai, h->target_name[tid], 0, 0x7fffffff, &ref_len);
+			mplp_ref_put(refs, ref_tid);
+			ref = mplp_ref_get(refs, tid, &ref_len);
 			for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid;
 			ref_tid = tid;
 		}
 		if (conf->flag & MPLP_GLF) {
-			int total_depth, _ref0, ref16;
-			bcf1_t *b = calloc(1, sizeof(bcf1_t));
-			for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
-			group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
-			_ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
-			ref16 = bam_nt16_table[_ref0];
-			for (i = 0; i < gplp.n; ++i)
-				bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], ref16, bca, bcr + i);
-			bcf_call_combine(gplp.n, bcr, ref16, &bc);
-			bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, 0, 0);
-			bcf_write(bp, bh, b);
-			bcf_destroy(b);
-			// call indels
-			if (!(conf->flag&MPLP_NO_INDEL) && total_depth < max_indel_depth && bcf_call_gap_prep(gplp.n, gplp.n_plp, gplp.plp, pos, bca, ref, rghash) >= 0) {
-				for (i = 0; i < gplp.n; ++i)
-					bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], -1, bca, bcr + i);
-				if (bcf_call_combine(gplp.n, bcr, -1, &bc) >= 0) {
-					b = calloc(1, sizeof(bcf1_t));
-					bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, bca, ref);
-					bcf_write(bp, bh, b);
-					bcf_destroy(b);
-				}
-			}
+			mplp_call(&g, caller, tid, pos, n_plp, plp, ref, ref_len, bp, 0);
 		} else {
-			printf("%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
-			for (i = 0; i < n; ++i) {
-				int j, cnt;
-				for (j = cnt = 0; j < n_plp[i]; ++j) {
-					const bam_pileup1_t *p = plp[i] + j;
-					if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ) ++cnt;
-				}
-				printf("\t%d\t", cnt);
-				if (n_plp[i] == 0) {
-					printf("*\t*"); // FIXME: printf() is very slow...
-					if (conf->flag & MPLP_PRINT_POS) printf("\t*");
-				} else {
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
-						if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
-							pileup_seq(plp[i] + j, pos, ref_len, ref);
-					}
-					putchar('\t');
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
-						int c = bam1_qual(p->b)[p->qpos];
-						if (c >= conf->min_baseQ) {
-							c = c + 33 < 126? c + 33 : 126;
-							putchar(c);
-						}
-					}
-					if (conf->flag & MPLP_PRINT_MAPQ) {
-						putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
-							int c = plp[i][j].b->core.qual + 33;
-							if (c > 126) c = 126;
-							putchar(c);
-						}
-					}
-					if (conf->flag & MPLP_PRINT_POS) {
-						putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
-							if (j > 0) putchar(',');
-							printf("%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
-						}
-					}
-				}
+			mplp_print(conf, h->target_name[tid], n, pos, n_plp, plp, ref, ref_len, &out);
+			if (out.l >= MPLP_OUT_BLOCK) {
+				fwrite(out.s, 1, out.l, stdout);
+				out.l = 0;
 			}
-			putchar('\n');
 		}
 	}
+	if (out.l) fwrite(out.s, 1, out.l, stdout);
+	free(out.s);
+
+	bam_mplp_destroy(iter);
 
+mplp_end:
 	bcf_close(bp);
-	bam_smpl_destroy(sm); free(buf.s);
-	for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
-	free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
+	bam_smpl_destroy(sm);
+	if (caller) mplp_caller_destroy(caller);
 	bcf_call_del_rghash(rghash);
-	bcf_hdr_destroy(bh); bcf_call_destroy(bca); free(bc.PL); free(bcr);
-	bam_mplp_destroy(iter);
+	bcf_hdr_destroy(bh);
 	bam_header_destroy(h);
+	mplp_ref_put(refs, ref_tid);
 	for (i = 0; i < n; ++i) {
 		bam_close(data[i]->fp);
 		if (data[i]->iter) bam_iter_destroy(data[i]->iter);
 		free(data[i]);
 	}
-	free(data); free(plp); free(ref); free(n_plp);
+	mplp_ref_destroy(refs);
+	free(data); free(plp); free(n_plp);
 	return 0;
 }
 
@@ -449,7 +813,7 @@ int bam_mpileup(int argc, char *argv[])
 	mplp.openQ = 40; mplp.extQ = 20; mplp.tandemQ = 100;
 	mplp.min_frac = 0.002; mplp.min_support = 1;
 	mplp.flag = MPLP_NO_ORPHAN | MPLP_REALN | MPLP_EXT_BAQ;
-	while ((c = getopt(argc, argv, "Agf:r:l:M:q:Q:uaRC:BDSd:L:b:P:o:e:h:Im:F:EG:6OsV")) >= 0) {
+	while ((c = getopt(argc, argv, "Agf:r:l:M:q:Q:uaRC:BDSd:L:b:P:o:e:h:Im:F:EG:6OsV@:")) >= 0) {
 		switch (c) {
 		case 'f':
 			mplp.fai = fai_load(optarg);
@@ -484,6 +848,7 @@ int bam_mpileup(int argc, char *argv[])
 		case 'F': mplp.min_frac = atof(optarg); break;
 		case 'm': mplp.min_support = atoi(optarg); break;
 		case 'L': mplp.max_indel_depth = atoi(optarg); break;
+		case '@': mplp.n_threads = atoi(optarg); break;
 		case 'G': {
 				FILE *fp_rg;
 				char buf[1024];
@@ -524,6 +889,7 @@ int bam_mpileup(int argc, char *argv[])
 		fprintf(stderr, "       -s           output mapping quality (disabled by -g/-u)\n");
 		fprintf(stderr, "       -S           output per-sample strand bias P-value in BCF (require -g/-u)\n");
 		fprintf(stderr, "       -u           generate uncompress BCF output\n");
+		fprintf(stderr, "       -@ INT       number of threads computing BCF output from indexed BAMs [1]\n");
 		fprintf(stderr, "\nSNP/INDEL genotype likelihoods options (effective with `-g' or `-u'):\n\n");
 		fprintf(stderr, "       -e INT       Phred-scaled gap extension seq error probability [%d]\n", mplp.extQ);
 		fprintf(stderr, "       -F FLOAT     minimum fraction of gapped reads for candidates [%g]\n", mplp.min_frac);
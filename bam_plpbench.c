@@ -0,0 +1,84 @@
+/* This program measures the throughput of the pileup engine: it piles up
+ * a BAM file, optionally in a region, without processing the columns and
+ * reports the numbers of positions and read positions per second.
+ * To compile, run `make plpbench'.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "bam.h"
+
+typedef struct {
+	bamFile fp;
+	bam_iter_t iter;
+} aux_t;
+
+static int read_bam(void *data, bam1_t *b)
+{
+	aux_t *aux = (aux_t*)data;
+	return aux->iter? bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+}
+
+static double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, tid, pos, n_plp, n_rep = 1, r;
+	char *reg = 0;
+	uint64_t n_pos = 0, n_rpos = 0;
+	double t, t_all = 0.;
+	bam_header_t *h;
+
+	while ((c = getopt(argc, argv, "r:n:")) >= 0) {
+		switch (c) {
+			case 'r': reg = optarg; break;
+			case 'n': n_rep = atoi(optarg); break;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: plpbench [-r reg] [-n nRepeats] <in.bam>\n");
+		return 1;
+	}
+	for (r = 0; r < n_rep; ++r) {
+		aux_t aux;
+		bam_plp_t plp;
+		uint64_t np, nr;
+		aux.fp = bam_open(argv[optind], "r");
+		if (aux.fp == 0) {
+			fprintf(stderr, "[%s] fail to open file '%s'.\n", __func__, argv[optind]);
+			return 1;
+		}
+		h = bam_header_read(aux.fp);
+		aux.iter = 0;
+		if (reg) {
+			int beg, end;
+			bam_index_t *idx;
+			if (bam_parse_region(h, reg, &tid, &beg, &end) < 0 || (idx = bam_index_load(argv[optind])) == 0) {
+				fprintf(stderr, "[%s] fail to parse region '%s' or to load the index.\n", __func__, reg);
+				return 1;
+			}
+			aux.iter = bam_iter_query(idx, tid, beg, end);
+			bam_index_destroy(idx);
+		}
+		plp = bam_plp_init(read_bam, &aux);
+		t = realtime();
+		while (bam_plp_auto(plp, &tid, &pos, &n_plp) != 0);
+		t_all += realtime() - t;
+		bam_plp_stat(plp, &np, &nr);
+		n_pos += np; n_rpos += nr;
+		bam_plp_destroy(plp);
+		if (aux.iter) bam_iter_destroy(aux.iter);
+		bam_header_destroy(h);
+		bam_close(aux.fp);
+	}
+	printf("positions\t%llu\nread_positions\t%llu\nseconds\t%.3f\npositions/s\t%.0f\nread_positions/s\t%.0f\n",
+		   (unsigned long long)n_pos, (unsigned long long)n_rpos, t_all, n_pos / t_all, n_rpos / t_all);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/* This program measures the record decoding throughput of a BAM file: it
+ * reads all records with bam_read1(), which decodes records lying inside
+ * the current BGZF block in place, and with three bgzf_read() calls per
+ * record as bam_read1() used to do, and reports records per second.
+ * To compile, run `make readbench'.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "bam.h"
+
+static double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+// bam_read1() before in-place decoding; little-endian only
+static int read1_copy(bamFile fp, bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
+	int32_t block_len, ret;
+	uint32_t x[8];
+	if ((ret = bam_read(fp, &block_len, 4)) != 4) return ret == 0? -1 : -2;
+	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+	c->tid = x[0]; c->pos = x[1];
+	c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
+	c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	b->data_len = block_len - BAM_CORE_SIZE;
+	if (b->m_data < b->data_len) {
+		b->m_data = b->data_len;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+	}
+	if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
+	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
+	return 4 + block_len;
+}
+
+static int run(const char *fn, int is_copy, uint64_t *n_rec, uint64_t *sum, double *t)
+{
+	bamFile fp;
+	bam_header_t *h;
+	bam1_t *b;
+	double t0;
+	int ret;
+	if ((fp = bam_open(fn, "r")) == 0) {
+		fprintf(stderr, "[%s] fail to open file '%s'.\n", __func__, fn);
+		return -1;
+	}
+	h = bam_header_read(fp);
+	b = bam_init1();
+	t0 = realtime();
+	if (is_copy) {
+		while ((ret = read1_copy(fp, b)) >= 0) ++*n_rec, *sum += b->core.pos + b->data_len;
+	} else {
+		while ((ret = bam_read1(fp, b)) >= 0) ++*n_rec, *sum += b->core.pos + b->data_len;
+	}
+	*t += realtime() - t0;
+	bam_destroy1(b);
+	bam_header_destroy(h);
+	bam_close(fp);
+	if (ret < -1) fprintf(stderr, "[%s] truncated file.\n", __func__);
+	return ret < -1? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, r, i, n_rep = 1;
+	uint64_t n_rec[2], sum[2];
+	double t[2];
+
+	while ((c = getopt(argc, argv, "n:")) >= 0) {
+		switch (c) {
+			case 'n': n_rep = atoi(optarg); break;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: readbench [-n nRepeats] <in.bam>\n");
+		return 1;
+	}
+	if (bam_is_be) {
+		fprintf(stderr, "[%s] the copying reader is little-endian only.\n", __func__);
+		return 1;
+	}
+	memset(n_rec, 0, sizeof(n_rec)); memset(sum, 0, sizeof(sum)); memset(t, 0, sizeof(t));
+	for (r = 0; r < n_rep; ++r)
+		for (i = 0; i < 2; ++i)
+			if (run(argv[optind], i, &n_rec[i], &sum[i], &t[i]) < 0) return 1;
+	if (n_rec[0] != n_rec[1] || sum[0] != sum[1]) {
+		fprintf(stderr, "[%s] the two readers disagree.\n", __func__);
+		return 1;
+	}
+	printf("records\t%llu\n", (unsigned long long)n_rec[0]);
+	printf("bam_read1\t%.3f sec\t%.0f records/s\n", t[0], n_rec[0] / t[0]);
+	printf("three_reads\t%.3f sec\t%.0f records/s\n", t[1], n_rec[1] / t[1]);
+	return 0;
+}
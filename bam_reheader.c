@@ -20,11 +20,10 @@ int bam_reheader(BGZF *in, const bam_header_t *h, int fd)
 		bgzf_write(fp, in->uncompressed_block + in->block_offset, in->block_length - in->block_offset);
 		bgzf_flush(fp);
 	}
+	while ((len = bgzf_raw_read(in, buf, BUF_SIZE)) > 0)
 #ifdef _USE_KNETFILE
-	while ((len = knet_read(in->x.fpr, buf, BUF_SIZE)) > 0)
 		fwrite(buf, 1, len, fp->x.fpw);
 #else
-	while (!feof(in->file) && (len = fread(buf, 1, BUF_SIZE, in->file)) > 0)
 		fwrite(buf, 1, len, fp->file);
 #endif
 	free(buf);
@@ -178,10 +178,11 @@ void bam_rmdupse_core(samfile_t *in, samfile_t *out, int force_se);
 
 int bam_rmdup(int argc, char *argv[])
 {
-	int c, is_se = 0, force_se = 0;
+	int c, is_se = 0, force_se = 0, n_threads = 1;
 	samfile_t *in, *out;
-	while ((c = getopt(argc, argv, "sS")) >= 0) {
+	while ((c = getopt(argc, argv, "sS@:")) >= 0) {
 		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
 		case 's': is_se = 1; break;
 		case 'S': force_se = is_se = 1; break;
 		}
@@ -190,7 +191,8 @@ int bam_rmdup(int argc, char *argv[])
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:  samtools rmdup [-sS] <input.srt.bam> <output.bam>\n\n");
 		fprintf(stderr, "Option: -s    rmdup for SE reads\n");
-		fprintf(stderr, "        -S    treat PE reads as SE in rmdup (force -s)\n\n");
+		fprintf(stderr, "        -S    treat PE reads as SE in rmdup (force -s)\n");
+		fprintf(stderr, "        -@ INT  number of BAM compression threads [1]\n\n");
 		return 1;
 	}
 	in = samopen(argv[optind], "rb", 0);
@@ -199,6 +201,7 @@ int bam_rmdup(int argc, char *argv[])
 		fprintf(stderr, "[bam_rmdup] fail to read/write input files\n");
 		return 1;
 	}
+	if (n_threads > 1) samthreads(out, n_threads, 256);
 	if (is_se) bam_rmdupse_core(in, out, force_se);
 	else bam_rmdup_core(in, out);
 	samclose(in); samclose(out);
@@ -2,9 +2,11 @@
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "bam.h"
 #include "ksort.h"
 
@@ -30,12 +32,56 @@ static inline int strnum_cmp(const char *a, const char *b)
 	return *pa<*pb? -1 : *pa>*pb? 1 : 0;
 }
 
+/* Transform a read name into a collation key such that memcmp() on keys
+ * orders names in the same way as strnum_cmp(). A digit run becomes '0',
+ * the number of significant digits and the significant digits, so that
+ * runs are compared by value and against other characters as a digit
+ * would be. The name length is appended to break ties between runs with
+ * different leading zeros. Bytes above 0x7f, not allowed in read names,
+ * are compared as unsigned. The key is stored as a 16-bit length followed
+ * by the key itself; qkey must have room for QKEY_MAX bytes. */
+#define QKEY_MAX 1024
+
+static int qname_key(const char *name, uint8_t *qkey)
+{
+	const char *p = name;
+	uint8_t *q = qkey + 2;
+	int l;
+	while (*p) {
+		if (isdigit(*p)) {
+			const char *beg;
+			char max[24];
+			while (*p == '0') ++p;
+			for (beg = p; isdigit(*p); ++p);
+			if ((l = p - beg) >= 10) { // strtol() saturates at LONG_MAX
+				int l_max = sprintf(max, "%ld", LONG_MAX);
+				if (l > l_max || (l == l_max && strncmp(beg, max, l) > 0))
+					beg = max, l = l_max;
+			}
+			*q++ = '0'; *q++ = l;
+			memcpy(q, beg, l); q += l;
+		} else *q++ = *p++;
+	}
+	*q++ = 0; *q++ = p - name;
+	l = q - qkey - 2;
+	qkey[0] = l & 0xff; qkey[1] = l >> 8;
+	return l + 2;
+}
+
+static inline int qkey_cmp(const uint8_t *a, const uint8_t *b)
+{
+	int la = a[0] | a[1]<<8, lb = b[0] | b[1]<<8;
+	int t = memcmp(a + 2, b + 2, la < lb? la : lb);
+	return t? t : la - lb;
+}
+
 #define HEAP_EMPTY 0xffffffffffffffffull
 
 typedef struct {
 	int i;
 	uint64_t pos, idx;
 	bam1_t *b;
+	uint8_t *qkey; // collation key of the name of b when merging by names
 } heap1_t;
 
 #define __pos_cmp(a, b) ((a).pos > (b).pos || ((a).pos == (b).pos && ((a).i > (b).i || ((a).i == (b).i && (a).idx > (b).idx))))
@@ -45,12 +91,206 @@ static inline int heap_lt(const heap1_t a, const heap1_t b)
 	if (g_is_by_qname) {
 		int t;
 		if (a.b == 0 || b.b == 0) return a.b == 0? 1 : 0;
-		t = strnum_cmp(bam1_qname(a.b), bam1_qname(b.b));
+		t = qkey_cmp(a.qkey, b.qkey);
 		return (t > 0 || (t == 0 && __pos_cmp(a, b)));
 	} else return __pos_cmp(a, b);
 }
 
-KSORT_INIT(heap, heap1_t, heap_lt)
+/* The inputs of merging are combined with a loser tree: t[0] is the
+ * index of the winning input and t[1..n-1] hold the losers of the
+ * matches on the path, so replacing the winner takes one comparison per
+ * level. Leaf n is a virtual input that beats everything; it is only
+ * used to build the tree. */
+static inline int merge_before(const heap1_t *h, int n, int a, int b)
+{
+	if (a == n) return 1;
+	if (b == n) return 0;
+	return heap_lt(h[b], h[a]);
+}
+
+static void merge_adjust(int *t, const heap1_t *h, int n, int s)
+{
+	int p, x;
+	for (p = (s + n) >> 1; p > 0; p >>= 1)
+		if (merge_before(h, n, t[p], s))
+			x = t[p], t[p] = s, s = x; // the winner goes up
+	t[0] = s;
+}
+
+static void merge_build(int *t, const heap1_t *h, int n)
+{
+	int i;
+	for (i = 0; i < n; ++i) t[i] = n;
+	for (i = n - 1; i >= 0; --i) merge_adjust(t, h, n, i);
+}
+
+/* With multiple threads, every input is decoded by its own thread into a
+ * ring of MERGE_N_BATCH batches of MERGE_BATCH_SIZE alignments. */
+#define MERGE_BATCH_SIZE 256
+#define MERGE_N_BATCH 2
+/* When compressed blocks may be copied, the merging thread reads the
+ * inputs itself and each input inflates MERGE_MT_SUB_BLKS blocks per
+ * thread at a time instead. */
+#define MERGE_MT_SUB_BLKS 8
+
+typedef struct {
+	int n, i; // number of alignments read and the next alignment to serve
+	int ret; // return value of the last read; <0 at the end of the input
+	bam1_t *b;
+} merge_batch_t;
+
+typedef struct {
+	bamFile fp;
+	bam_iter_t iter;
+	bam1_t *b; // the current alignment in the single-threaded mode
+	merge_batch_t *q; // NULL in the single-threaded mode
+	int head, n_filled, stop;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+} merge_input_t;
+
+static void *merge_reader(void *data)
+{
+	merge_input_t *in = (merge_input_t*)data;
+	int ret;
+	do {
+		merge_batch_t *q;
+		pthread_mutex_lock(&in->lock);
+		while (in->n_filled == MERGE_N_BATCH && !in->stop)
+			pthread_cond_wait(&in->cv, &in->lock);
+		if (in->stop) {
+			pthread_mutex_unlock(&in->lock);
+			break;
+		}
+		q = &in->q[(in->head + in->n_filled) % MERGE_N_BATCH];
+		pthread_mutex_unlock(&in->lock);
+		for (q->n = q->i = 0, ret = 0; q->n < MERGE_BATCH_SIZE; ++q->n)
+			if ((ret = bam_iter_read(in->fp, in->iter, &q->b[q->n])) < 0) break;
+		q->ret = ret;
+		pthread_mutex_lock(&in->lock);
+		++in->n_filled;
+		pthread_cond_signal(&in->cv);
+		pthread_mutex_unlock(&in->lock);
+	} while (ret >= 0);
+	return 0;
+}
+
+static void merge_input_init(merge_input_t *in, bamFile fp, bam_iter_t iter, int is_mt)
+{
+	int i;
+	in->fp = fp; in->iter = iter;
+	if (!is_mt) {
+		in->b = bam_init1();
+		return;
+	}
+	in->q = (merge_batch_t*)calloc(MERGE_N_BATCH, sizeof(merge_batch_t));
+	for (i = 0; i < MERGE_N_BATCH; ++i)
+		in->q[i].b = (bam1_t*)calloc(MERGE_BATCH_SIZE, sizeof(bam1_t));
+	pthread_mutex_init(&in->lock, 0);
+	pthread_cond_init(&in->cv, 0);
+	pthread_create(&in->tid, 0, merge_reader, in);
+}
+
+static void merge_input_destroy(merge_input_t *in)
+{
+	int i, j;
+	if (in->q == 0) {
+		bam_destroy1(in->b);
+		return;
+	}
+	pthread_mutex_lock(&in->lock);
+	in->stop = 1;
+	pthread_cond_signal(&in->cv);
+	pthread_mutex_unlock(&in->lock);
+	pthread_join(in->tid, 0);
+	for (i = 0; i < MERGE_N_BATCH; ++i) {
+		for (j = 0; j < MERGE_BATCH_SIZE; ++j) free(in->q[i].b[j].data);
+		free(in->q[i].b);
+	}
+	free(in->q);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cv);
+}
+
+// get the next alignment from an input; return NULL at the end and set *ret as bam_read1()
+static bam1_t *merge_input_read(merge_input_t *in, int *ret)
+{
+	merge_batch_t *q;
+	if (in->q == 0) return (*ret = bam_iter_read(in->fp, in->iter, in->b)) >= 0? in->b : 0;
+	pthread_mutex_lock(&in->lock);
+	if (in->n_filled > 0 && in->q[in->head].i == in->q[in->head].n && in->q[in->head].ret >= 0) { // release the used batch
+		in->head = (in->head + 1) % MERGE_N_BATCH;
+		--in->n_filled;
+		pthread_cond_signal(&in->cv);
+	}
+	while (in->n_filled == 0)
+		pthread_cond_wait(&in->cv, &in->lock);
+	q = &in->q[in->head];
+	pthread_mutex_unlock(&in->lock);
+	if (q->i < q->n) {
+		*ret = 0;
+		return &q->b[q->i++];
+	}
+	*ret = q->ret;
+	return 0;
+}
+
+/* Test if all the alignments in the block just loaded from input i come
+ * before the current alignments of all the other inputs. If so, the
+ * block can be copied to the output without being recompressed. The
+ * block must hold whole alignments only. */
+static int merge_block_wins(BGZF *fp, const heap1_t *heap, int n, int i, int by_qname)
+{
+	const uint8_t *p = (const uint8_t*)fp->uncompressed_block;
+	int j, off = 0, last = -1;
+	uint32_t x[8];
+	uint8_t qkey[QKEY_MAX];
+	heap1_t h;
+	while (off + 4 <= fp->block_length) {
+		int32_t block_len;
+		memcpy(&block_len, p + off, 4);
+		if (block_len < (int32_t)BAM_CORE_SIZE || block_len > fp->block_length - off - 4) return 0;
+		last = off;
+		off += 4 + block_len;
+	}
+	if (last < 0 || off != fp->block_length) return 0; // an alignment spans blocks
+	memcpy(x, p + last + 4, BAM_CORE_SIZE);
+	memset(&h, 0, sizeof(heap1_t));
+	h.i = i;
+	h.pos = ((uint64_t)x[0]<<32) | (uint32_t)((int32_t)x[1]+1)<<1 | ((x[3]>>16 & BAM_FREVERSE) != 0);
+	h.idx = 0; // not compared: the other inputs differ in h.i
+	h.b = (bam1_t*)p; // only tested for NULL by heap_lt()
+	if (by_qname) {
+		qname_key((const char*)p + last + 4 + BAM_CORE_SIZE, qkey);
+		h.qkey = qkey;
+	}
+	for (j = 0; j < n; ++j)
+		if (j != i && !heap_lt(heap[j], h)) return 0;
+	return 1;
+}
+
+// copy the following blocks of the winning input i as long as they entirely come first
+static void merge_copy_blocks(BGZF *out, BGZF *fp, const heap1_t *heap, int n, int i, int by_qname)
+{
+	while (fp->block_offset == 0 && fp->block_length == 0) { // at a block boundary
+		if (bgzf_read_block(fp) != 0 || fp->block_length == 0) break;
+		if (!merge_block_wins(fp, heap, n, i, by_qname) || bgzf_copy_block(out, fp) != 0) break;
+	}
+}
+
+static void merge_next(heap1_t *h, merge_input_t *in, uint64_t *idx, int by_qname, const char *fn)
+{
+	int ret;
+	if ((h->b = merge_input_read(in, &ret)) != 0) {
+		h->pos = ((uint64_t)h->b->core.tid<<32) | (uint32_t)((int32_t)h->b->core.pos+1)<<1 | bam1_strand(h->b);
+		h->idx = (*idx)++;
+		if (by_qname) qname_key(bam1_qname(h->b), h->qkey);
+	} else {
+		if (ret < -1) fprintf(stderr, "[bam_merge_core] '%s' is truncated. Continue anyway.\n", fn);
+		h->pos = HEAP_EMPTY;
+	}
+}
 
 static void swap_header_targets(bam_header_t *h1, bam_header_t *h2)
 {
@@ -72,6 +312,8 @@ static void swap_header_text(bam_header_t *h1, bam_header_t *h2)
 #define MERGE_UNCOMP 2
 #define MERGE_LEVEL1 4
 #define MERGE_FORCE  8
+#define MERGE_NOCOPY 16 // never copy compressed blocks from the input
+#define MERGE_INDEX  32 // build the index of the output while writing it
 
 /*!
   @abstract    Merge multiple sorted BAM.
@@ -81,18 +323,21 @@ static void swap_header_text(bam_header_t *h1, bam_header_t *h2)
                    or NULL to copy them from the first file to be merged
   @param  n    number of files to be merged
   @param  fn   names of files to be merged
+  @param  n_threads  number of threads compressing the output
 
   @discussion Padding information may NOT correctly maintained. This
   function is NOT thread safe.
  */
-int bam_merge_core(int by_qname, const char *out, const char *headers, int n, char * const *fn,
-					int flag, const char *reg)
+int bam_merge_core2(int by_qname, const char *out, const char *headers, int n, char * const *fn,
+					int flag, const char *reg, int n_threads)
 {
 	bamFile fpout, *fp;
 	heap1_t *heap;
+	merge_input_t *in;
+	int *t, blkcopy;
 	bam_header_t *hout = 0;
 	bam_header_t *hheaders = NULL;
-	int i, j, *RG_len = 0;
+	int i, j, *RG_len = 0, ret = 0;
 	uint64_t idx = 0;
 	char **RG = 0;
 	bam_iter_t *iter = 0;
@@ -199,15 +444,19 @@ int bam_merge_core(int by_qname, const char *out, const char *headers, int n, ch
 		}
 	}
 
+	// copy compressed blocks when alignments are neither modified nor recompressed at another level
+	blkcopy = !(flag & (MERGE_RG|MERGE_UNCOMP|MERGE_LEVEL1|MERGE_NOCOPY|MERGE_INDEX)) && reg == 0 && !bam_is_be;
+	in = (merge_input_t*)calloc(n, sizeof(merge_input_t));
+	for (i = 0; i < n; ++i) {
+		// blocks that may be copied are read in the merging thread, but still all inflated; do that in parallel
+		if (n_threads > 1 && blkcopy) bgzf_mt(fp[i], n_threads, MERGE_MT_SUB_BLKS);
+		merge_input_init(&in[i], fp[i], iter[i], n_threads > 1 && !blkcopy);
+	}
 	for (i = 0; i < n; ++i) {
 		heap1_t *h = heap + i;
 		h->i = i;
-		h->b = (bam1_t*)calloc(1, sizeof(bam1_t));
-		if (bam_iter_read(fp[i], iter[i], h->b) >= 0) {
-			h->pos = ((uint64_t)h->b->core.tid<<32) | (uint32_t)((int32_t)h->b->core.pos+1)<<1 | bam1_strand(h->b);
-			h->idx = idx++;
-		}
-		else h->pos = HEAP_EMPTY;
+		if (by_qname) h->qkey = (uint8_t*)malloc(QKEY_MAX);
+		merge_next(h, &in[i], &idx, by_qname, fn[i]);
 	}
 	if (flag & MERGE_UNCOMP) fpout = strcmp(out, "-")? bam_open(out, "wu") : bam_dopen(fileno(stdout), "wu");
 	else if (flag & MERGE_LEVEL1) fpout = strcmp(out, "-")? bam_open(out, "w1") : bam_dopen(fileno(stdout), "w1");
@@ -217,48 +466,56 @@ int bam_merge_core(int by_qname, const char *out, const char *headers, int n, ch
 		return -1;
 	}
 	bam_header_write(fpout, hout);
+	if (n_threads > 1) bgzf_mt(fpout, n_threads, 256);
+	if (flag & MERGE_INDEX) bam_index_otf_init(fpout, hout->n_targets);
 	bam_header_destroy(hout);
 
-	ks_heapmake(heap, n, heap);
-	while (heap->pos != HEAP_EMPTY) {
-		bam1_t *b = heap->b;
+	t = (int*)calloc(n, sizeof(int));
+	merge_build(t, heap, n);
+	while (heap[t[0]].pos != HEAP_EMPTY) {
+		heap1_t *h = &heap[t[0]];
+		bam1_t *b = h->b;
 		if (flag & MERGE_RG) {
 			uint8_t *rg = bam_aux_get(b, "RG");
 			if (rg) bam_aux_del(b, rg);
-			bam_aux_append(b, "RG", 'Z', RG_len[heap->i] + 1, (uint8_t*)RG[heap->i]);
+			bam_aux_append(b, "RG", 'Z', RG_len[h->i] + 1, (uint8_t*)RG[h->i]);
 		}
 		bam_write1_core(fpout, &b->core, b->data_len, b->data);
-		if ((j = bam_iter_read(fp[heap->i], iter[heap->i], b)) >= 0) {
-			heap->pos = ((uint64_t)b->core.tid<<32) | (uint32_t)((int)b->core.pos+1)<<1 | bam1_strand(b);
-			heap->idx = idx++;
-		} else if (j == -1) {
-			heap->pos = HEAP_EMPTY;
-			free(heap->b->data); free(heap->b);
-			heap->b = 0;
-		} else fprintf(stderr, "[bam_merge_core] '%s' is truncated. Continue anyway.\n", fn[heap->i]);
-		ks_heapadjust(heap, 0, n, heap);
+		if (blkcopy) merge_copy_blocks(fpout, fp[h->i], heap, n, h->i, by_qname);
+		merge_next(h, &in[h->i], &idx, by_qname, fn[h->i]);
+		merge_adjust(t, heap, n, h->i);
 	}
+	free(t);
 
 	if (flag & MERGE_RG) {
 		for (i = 0; i != n; ++i) free(RG[i]);
 		free(RG); free(RG_len);
 	}
 	for (i = 0; i != n; ++i) {
+		merge_input_destroy(&in[i]);
 		bam_iter_destroy(iter[i]);
 		bam_close(fp[i]);
 	}
+	if ((flag & MERGE_INDEX) && bam_index_otf_save(fpout, out) < 0) ret = -1;
 	bam_close(fpout);
-	free(fp); free(heap); free(iter);
-	return 0;
+	for (i = 0; i != n; ++i) free(heap[i].qkey);
+	free(fp); free(heap); free(iter); free(in);
+	return ret;
+}
+
+int bam_merge_core(int by_qname, const char *out, const char *headers, int n, char * const *fn, int flag, const char *reg)
+{
+	return bam_merge_core2(by_qname, out, headers, n, fn, flag, reg, 1);
 }
 
 int bam_merge(int argc, char *argv[])
 {
-	int c, is_by_qname = 0, flag = 0, ret = 0;
+	int c, is_by_qname = 0, flag = 0, ret = 0, n_threads = 1;
 	char *fn_headers = NULL, *reg = 0;
 
-	while ((c = getopt(argc, argv, "h:nru1R:f")) >= 0) {
+	while ((c = getopt(argc, argv, "h:nru1R:fi@:")) >= 0) {
 		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
 		case 'r': flag |= MERGE_RG; break;
 		case 'f': flag |= MERGE_FORCE; break;
 		case 'h': fn_headers = strdup(optarg); break;
@@ -266,17 +523,20 @@ int bam_merge(int argc, char *argv[])
 		case '1': flag |= MERGE_LEVEL1; break;
 		case 'u': flag |= MERGE_UNCOMP; break;
 		case 'R': reg = strdup(optarg); break;
+		case 'i': flag |= MERGE_INDEX; break;
 		}
 	}
 	if (optind + 2 >= argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   samtools merge [-nr] [-h inh.sam] <out.bam> <in1.bam> <in2.bam> [...]\n\n");
+		fprintf(stderr, "Usage:   samtools merge [-nri] [-h inh.sam] <out.bam> <in1.bam> <in2.bam> [...]\n\n");
 		fprintf(stderr, "Options: -n       sort by read names\n");
 		fprintf(stderr, "         -r       attach RG tag (inferred from file names)\n");
 		fprintf(stderr, "         -u       uncompressed BAM output\n");
 		fprintf(stderr, "         -f       overwrite the output BAM if exist\n");
 		fprintf(stderr, "         -1       compress level 1\n");
+		fprintf(stderr, "         -i       write the index <out.bam>.bai while merging\n");
 		fprintf(stderr, "         -R STR   merge file in the specified region STR [all]\n");
+		fprintf(stderr, "         -@ INT   number of BAM compression threads [1]\n");
 		fprintf(stderr, "         -h FILE  copy the header in FILE to <out.bam> [in1.bam]\n\n");
 		fprintf(stderr, "Note: Samtools' merge does not reconstruct the @RG dictionary in the header. Users\n");
 		fprintf(stderr, "      must provide the correct header with -h, or uses Picard which properly maintains\n");
@@ -291,29 +551,148 @@ int bam_merge(int argc, char *argv[])
 			return 1;
 		}
 	}
-	if (bam_merge_core(is_by_qname, argv[optind], fn_headers, argc - optind - 1, argv + optind + 1, flag, reg) < 0) ret = 1;
+	if ((flag & MERGE_INDEX) && (is_by_qname || strcmp(argv[optind], "-") == 0)) {
+		fprintf(stderr, "[%s] option -i requires sorting by coordinate and an output file.\n", __func__);
+		return 1;
+	}
+	if (bam_merge_core2(is_by_qname, argv[optind], fn_headers, argc - optind - 1, argv + optind + 1, flag, reg, n_threads) < 0) ret = 1;
 	free(reg);
 	free(fn_headers);
 	return ret;
 }
 
-typedef bam1_t *bam1_p;
+typedef struct {
+	uint64_t key; // tid<<32|(pos+1)<<1|strand, as in merge_next(); unmapped reads with tid<0 come last
+	bam1_t *b; // the alignment in the sort buffer
+} sort_entry_t;
+
+#define sort_qkey(b) ((b)->data + (b)->data_len) // in the sort buffer, the name key follows the data
 
-static inline int bam1_lt(const bam1_p a, const bam1_p b)
+static inline int sort_lt(const sort_entry_t a, const sort_entry_t b)
 {
 	if (g_is_by_qname) {
-		int t = strnum_cmp(bam1_qname(a), bam1_qname(b));
-		return (t < 0 || (t == 0 && (((uint64_t)a->core.tid<<32|(a->core.pos+1)) < ((uint64_t)b->core.tid<<32|(b->core.pos+1)))));
-	} else return (((uint64_t)a->core.tid<<32|(a->core.pos+1)) < ((uint64_t)b->core.tid<<32|(b->core.pos+1)));
+		int t = qkey_cmp(sort_qkey(a.b), sort_qkey(b.b));
+		return (t < 0 || (t == 0 && a.key < b.key));
+	} else return a.key < b.key;
+}
+KSORT_INIT(sort, sort_entry_t, sort_lt)
+
+/* A sort buffer is a single block of max_mem bytes. Entries are appended
+ * at the beginning, followed by room for as many entries again, which
+ * ks_mergesort() uses as its temporary array. Alignments, each a bam1_t
+ * followed by its data and, when sorting by names, the name key, are
+ * stacked downwards from the end. The buffer is
+ * full when the two meet, so the memory used is bounded by max_mem. */
+typedef struct {
+	size_t max_mem, top; // top: offset of the lowest alignment
+	int n; // number of entries
+	uint8_t *mem;
+} sort_buf_t;
+
+#define sort_buf_entries(s) ((sort_entry_t*)(s)->mem)
+
+static void sort_buf_init(sort_buf_t *s, size_t max_mem)
+{
+	s->max_mem = max_mem;
+	s->mem = (uint8_t*)malloc(max_mem);
+	s->top = max_mem; s->n = 0;
+}
+
+// copy b into the buffer; return 0 if the buffer is full
+static int sort_buf_push(sort_buf_t *s, const bam1_t *b)
+{
+	size_t size = sizeof(bam1_t) + b->data_len, top;
+	sort_entry_t *e;
+	bam1_t *p;
+	uint8_t qkey[QKEY_MAX];
+	int l_qkey = 0;
+	if (g_is_by_qname) size += (l_qkey = qname_key(bam1_qname(b), qkey));
+	if (s->n == 0 && size + 2 * sizeof(sort_entry_t) + 8 > s->max_mem) { // a huge alignment in a tiny buffer
+		s->max_mem = s->top = size + 2 * sizeof(sort_entry_t) + 8;
+		s->mem = (uint8_t*)realloc(s->mem, s->max_mem);
+	}
+	if (size > s->top) return 0;
+	top = (s->top - size) & ~(size_t)7;
+	if (top < 2 * (s->n + 1) * sizeof(sort_entry_t)) return 0;
+	p = (bam1_t*)(s->mem + top);
+	p->core = b->core;
+	p->l_aux = b->l_aux;
+	p->data_len = p->m_data = b->data_len;
+	p->data = (uint8_t*)(p + 1);
+	memcpy(p->data, b->data, b->data_len);
+	if (l_qkey) memcpy(sort_qkey(p), qkey, l_qkey);
+	e = &sort_buf_entries(s)[s->n++];
+	e->key = (uint64_t)b->core.tid<<32 | (uint32_t)((int32_t)b->core.pos+1)<<1 | bam1_strand(b);
+	e->b = p;
+	s->top = top;
+	return 1;
+}
+
+// stable LSD radix sort on sort_entry_t::key; bytes shared by all keys are skipped
+static void sort_radix(size_t n, sort_entry_t *a, sort_entry_t *t)
+{
+	size_t i, cnt[8][256];
+	sort_entry_t *src = a, *dst = t, *tmp;
+	int d;
+	if (n < 2) return;
+	memset(cnt, 0, sizeof(cnt));
+	for (i = 0; i < n; ++i) { // histograms of all the eight bytes in one pass
+		uint64_t key = a[i].key;
+		for (d = 0; d < 8; ++d, key >>= 8) ++cnt[d][key&0xff];
+	}
+	for (d = 0; d < 8; ++d) {
+		size_t x, sum = 0, *c = cnt[d];
+		int shift = d * 8;
+		if (c[a[0].key>>shift&0xff] == n) continue; // nothing to do with this byte
+		for (x = 0; x < 256; ++x) {
+			size_t y = c[x];
+			c[x] = sum, sum += y;
+		}
+		for (i = 0; i < n; ++i)
+			dst[c[src[i].key>>shift&0xff]++] = src[i];
+		tmp = src, src = dst, dst = tmp;
+	}
+	if (src != a) memcpy(a, src, n * sizeof(sort_entry_t));
 }
-KSORT_INIT(sort, bam1_p, bam1_lt)
 
-static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam_header_t *h, int is_stdout)
+typedef struct {
+	size_t n;
+	sort_entry_t *a, *t; // array to sort and the temporary array
+} sort_part_t;
+
+static void *sort_worker(void *data)
+{
+	sort_part_t *p = (sort_part_t*)data;
+	if (g_is_by_qname) ks_mergesort(sort, p->n, p->a, p->t);
+	else sort_radix(p->n, p->a, p->t);
+	return 0;
+}
+
+static void sort_blocks(int n, sort_buf_t *buf, const char *prefix, const bam_header_t *h, int is_stdout, int write_index, int n_threads)
 {
 	char *name, mode[3];
-	int i;
+	int i, n_parts;
 	bamFile fp;
-	ks_mergesort(sort, k, buf, 0);
+	sort_entry_t *e = sort_buf_entries(buf);
+	sort_part_t *part;
+	size_t *k;
+	// split the buffer into n_threads parts and sort them in parallel
+	n_parts = n_threads > 1 && buf->n >= n_threads * 1024? n_threads : 1;
+	part = (sort_part_t*)calloc(n_parts, sizeof(sort_part_t));
+	k = (size_t*)calloc(n_parts, sizeof(size_t));
+	for (i = 0; i < n_parts; ++i) {
+		size_t beg = (size_t)buf->n * i / n_parts, end = (size_t)buf->n * (i + 1) / n_parts;
+		part[i].n = end - beg;
+		part[i].a = e + beg;
+		part[i].t = e + buf->n + beg;
+	}
+	if (n_parts > 1) {
+		pthread_t *tid = (pthread_t*)calloc(n_parts, sizeof(pthread_t));
+		for (i = 1; i < n_parts; ++i) pthread_create(&tid[i], 0, sort_worker, &part[i]);
+		sort_worker(&part[0]);
+		for (i = 1; i < n_parts; ++i) pthread_join(tid[i], 0);
+		free(tid);
+	} else sort_worker(&part[0]);
 	name = (char*)calloc(strlen(prefix) + 20, 1);
 	if (n >= 0) {
 		sprintf(name, "%s.%.4d.bam", prefix, n);
@@ -329,11 +708,37 @@ static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam
 		// FIXME: possible memory leak
 		return;
 	}
-	free(name);
 	bam_header_write(fp, h);
-	for (i = 0; i < k; ++i)
-		bam_write1_core(fp, &buf[i]->core, buf[i]->data_len, buf[i]->data);
+	if (n_threads > 1) bgzf_mt(fp, n_threads, 256);
+	if (write_index) bam_index_otf_init(fp, h->n_targets);
+	for (;;) { // merge the sorted parts; a tie goes to the earlier part, which keeps the sort stable
+		int j = -1;
+		bam1_t *b;
+		for (i = 0; i < n_parts; ++i)
+			if (k[i] < part[i].n && (j < 0 || sort_lt(part[i].a[k[i]], part[j].a[k[j]]))) j = i;
+		if (j < 0) break;
+		b = part[j].a[k[j]++].b;
+		bam_write1_core(fp, &b->core, b->data_len, b->data);
+	}
+	if (write_index) bam_index_otf_save(fp, name);
 	bam_close(fp);
+	free(name);
+	free(part); free(k);
+	buf->n = 0; buf->top = buf->max_mem;
+}
+
+typedef struct {
+	int n, n_threads;
+	sort_buf_t *buf;
+	const char *prefix;
+	const bam_header_t *h;
+} sort_job_t;
+
+static void *sort_blocks_worker(void *data)
+{
+	sort_job_t *j = (sort_job_t*)data;
+	sort_blocks(j->n, j->buf, j->prefix, j->h, 0, 0, j->n_threads);
+	return 0;
 }
 
 /*!
@@ -344,48 +749,66 @@ static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam
   @param  fn       name of the file to be sorted
   @param  prefix   prefix of the output and the temporary files; upon
 	                   sucessess, prefix.bam will be written.
-  @param  max_mem  approxiate maximum memory (very inaccurate)
+  @param  max_mem  maximum memory for buffering alignments, including
+                   the sorting index
+  @param  write_index  whether to write prefix.bam.bai along with the
+                   output; requires sorting by coordinate
+  @param  n_threads  number of threads sorting and compressing
 
   @discussion It may create multiple temporary subalignment files
-  and then merge them by calling bam_merge_core(). This function is
-  NOT thread safe.
+  and then merge them by calling bam_merge_core(). With n_threads>1,
+  max_mem is split into two buffers: one is sorted and written to a
+  temporary file in the background while the other is being filled.
+  Alignments are sorted by the key they are merged by, so the output
+  does not depend on where runs are cut.
+  This function is NOT thread safe.
  */
-void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size_t max_mem, int is_stdout)
+void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size_t max_mem, int is_stdout, int write_index, int n_threads)
 {
-	int n, ret, k, i;
-	size_t mem;
+	int n, ret, i, cur = 0, is_writing = 0;
 	bam_header_t *header;
 	bamFile fp;
-	bam1_t *b, **buf;
+	bam1_t *b;
+	sort_buf_t buf[2];
+	sort_job_t job;
+	pthread_t tid;
 
 	g_is_by_qname = is_by_qname;
-	n = k = 0; mem = 0;
+	n = 0;
 	fp = strcmp(fn, "-")? bam_open(fn, "r") : bam_dopen(fileno(stdin), "r");
 	if (fp == 0) {
 		fprintf(stderr, "[bam_sort_core] fail to open file %s\n", fn);
 		return;
 	}
+	if (n_threads > 1) bgzf_mt(fp, n_threads, 256);
 	header = bam_header_read(fp);
-	buf = (bam1_t**)calloc(max_mem / BAM_CORE_SIZE, sizeof(bam1_t*));
+	sort_buf_init(&buf[0], n_threads > 1? max_mem / 2 : max_mem);
+	if (n_threads > 1) sort_buf_init(&buf[1], max_mem / 2);
+	else buf[1].mem = 0;
+	job.n_threads = n_threads; job.prefix = prefix; job.h = header;
+	b = bam_init1();
 	// write sub files
-	for (;;) {
-		if (buf[k] == 0) buf[k] = (bam1_t*)calloc(1, sizeof(bam1_t));
-		b = buf[k];
-		if ((ret = bam_read1(fp, b)) < 0) break;
-		mem += ret;
-		++k;
-		if (mem >= max_mem) {
-			sort_blocks(n++, k, buf, prefix, header, 0);
-			mem = 0; k = 0;
+	while ((ret = bam_read1(fp, b)) >= 0) {
+		if (!sort_buf_push(&buf[cur], b)) {
+			if (n_threads > 1) { // sort and write in the background and continue reading into the other buffer
+				if (is_writing) pthread_join(tid, 0);
+				job.n = n++; job.buf = &buf[cur];
+				pthread_create(&tid, 0, sort_blocks_worker, &job);
+				is_writing = 1; cur ^= 1;
+			} else sort_blocks(n++, &buf[cur], prefix, header, 0, 0, n_threads);
+			sort_buf_push(&buf[cur], b);
 		}
 	}
+	if (is_writing) pthread_join(tid, 0);
 	if (ret != -1)
 		fprintf(stderr, "[bam_sort_core] truncated file. Continue anyway.\n");
-	if (n == 0) sort_blocks(-1, k, buf, prefix, header, is_stdout);
+	if (n == 0) sort_blocks(-1, &buf[cur], prefix, header, is_stdout, write_index, n_threads);
 	else { // then merge
 		char **fns, *fnout;
 		fprintf(stderr, "[bam_sort_core] merging from %d files...\n", n+1);
-		sort_blocks(n++, k, buf, prefix, header, 0);
+		sort_blocks(n++, &buf[cur], prefix, header, 0, 0, n_threads);
+		free(buf[0].mem); free(buf[1].mem); // release the buffers before merging
+		buf[0].mem = buf[1].mem = 0;
 		fnout = (char*)calloc(strlen(prefix) + 20, 1);
 		if (is_stdout) sprintf(fnout, "-");
 		else sprintf(fnout, "%s.bam", prefix);
@@ -394,7 +817,7 @@ void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size
 			fns[i] = (char*)calloc(strlen(prefix) + 20, 1);
 			sprintf(fns[i], "%s.%.4d.bam", prefix, i);
 		}
-		bam_merge_core(is_by_qname, fnout, 0, n, fns, 0, 0);
+		bam_merge_core2(is_by_qname, fnout, 0, n, fns, MERGE_NOCOPY | (write_index? MERGE_INDEX : 0), 0, n_threads); // temporary files are compressed at level 1
 		free(fnout);
 		for (i = 0; i < n; ++i) {
 			unlink(fns[i]);
@@ -402,20 +825,15 @@ void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size
 		}
 		free(fns);
 	}
-	for (k = 0; k < max_mem / BAM_CORE_SIZE; ++k) {
-		if (buf[k]) {
-			free(buf[k]->data);
-			free(buf[k]);
-		}
-	}
-	free(buf);
+	free(buf[0].mem); free(buf[1].mem);
+	bam_destroy1(b);
 	bam_header_destroy(header);
 	bam_close(fp);
 }
 
 void bam_sort_core(int is_by_qname, const char *fn, const char *prefix, size_t max_mem)
 {
-	bam_sort_core_ext(is_by_qname, fn, prefix, max_mem, 0);
+	bam_sort_core_ext(is_by_qname, fn, prefix, max_mem, 0, 0, 1);
 }
 
 
@@ -446,18 +864,83 @@ size_t bam_sort_get_max_mem(char *max_mem_string)
 int bam_sort(int argc, char *argv[])
 {
 	size_t max_mem = 500000000;
-	int c, is_by_qname = 0, is_stdout = 0;
-	while ((c = getopt(argc, argv, "nom:")) >= 0) {
+	int c, is_by_qname = 0, is_stdout = 0, write_index = 0, n_threads = 1;
+	while ((c = getopt(argc, argv, "noim:@:")) >= 0) {
 		switch (c) {
+		case 'i': write_index = 1; break;
+		case '@': n_threads = atoi(optarg); break;
 		case 'o': is_stdout = 1; break;
 		case 'n': is_by_qname = 1; break;
 		case 'm': max_mem = bam_sort_get_max_mem(optarg); break;
 		}
 	}
 	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: samtools sort [-on] [-m <maxMem>] <in.bam> <out.prefix>\n");
+		fprintf(stderr, "Usage: samtools sort [-oni] [-m <maxMem>] [-@ <nThreads>] <in.bam> <out.prefix>\n");
+		return 1;
+	}
+	if (write_index && (is_by_qname || is_stdout)) {
+		fprintf(stderr, "[bam_sort] option -i requires sorting by coordinate and an output file.\n");
+		return 1;
+	}
+	bam_sort_core_ext(is_by_qname, argv[optind], argv[optind+1], max_mem, is_stdout, write_index, n_threads);
+	return 0;
+}
+
+#ifdef SORT_MAIN
+/* Benchmark the coordinate sort of the entries in a sort buffer: sort n
+ * random keys with sort_radix() and with ks_mergesort(). To compile, run
+ * `make sortbench'. */
+#include <sys/time.h>
+
+static double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, n_tid = 25;
+	size_t i, n = 50000000;
+	sort_entry_t *a, *b, *t;
+	double t_radix, t_merge;
+
+	while ((c = getopt(argc, argv, "n:t:")) >= 0) {
+		switch (c) {
+		case 'n': n = atol(optarg); break;
+		case 't': n_tid = atoi(optarg); break;
+		}
+	}
+	if (n == 0 || n_tid <= 0) {
+		fprintf(stderr, "Usage: sortbench [-n nRecords] [-t nTargets]\n");
+		return 1;
+	}
+	a = (sort_entry_t*)malloc(n * sizeof(sort_entry_t));
+	b = (sort_entry_t*)malloc(n * sizeof(sort_entry_t));
+	t = (sort_entry_t*)malloc(n * sizeof(sort_entry_t));
+	srand48(11);
+	for (i = 0; i < n; ++i) { // a few unmapped reads at tid -1
+		int32_t tid = lrand48() % (n_tid + 1) - 1;
+		int32_t pos = tid < 0? -1 : lrand48() % 250000000;
+		a[i].key = (uint64_t)tid<<32 | (uint32_t)(pos+1)<<1 | (tid < 0? 0 : lrand48()&1);
+		a[i].b = (bam1_t*)(size_t)i; // the input order, to check stability
+	}
+	memcpy(b, a, n * sizeof(sort_entry_t));
+	t_radix = realtime();
+	sort_radix(n, a, t);
+	t_radix = realtime() - t_radix;
+	t_merge = realtime();
+	ks_mergesort(sort, n, b, t);
+	t_merge = realtime() - t_merge;
+	for (i = 0; i < n; ++i)
+		if (a[i].key != b[i].key || a[i].b != b[i].b) break;
+	if (i < n) {
+		fprintf(stderr, "[%s] the two sorts disagree at %ld.\n", __func__, (long)i);
 		return 1;
 	}
-	bam_sort_core_ext(is_by_qname, argv[optind], argv[optind+1], max_mem, is_stdout);
+	printf("records\t%ld\nradix\t%.3f sec\nmergesort\t%.3f sec\nspeedup\t%.2f\n", (long)n, t_radix, t_merge, t_merge / t_radix);
+	free(a); free(b); free(t);
 	return 0;
 }
+#endif
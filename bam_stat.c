@@ -33,16 +33,17 @@ typedef struct {
 bam_flagstat_t *bam_flagstat_core(bamFile fp)
 {
 	bam_flagstat_t *s;
-	bam1_t *b;
-	bam1_core_t *c;
-	int ret;
+	bam_batch_t *bb;
+	int i, ret;
 	s = (bam_flagstat_t*)calloc(1, sizeof(bam_flagstat_t));
-	b = bam_init1();
-	c = &b->core;
-	while ((ret = bam_read1(fp, b)) >= 0)
-		flagstat_loop(s, c);
-	bam_destroy1(b);
-	if (ret != -1)
+	bb = bam_batch_init();
+	while ((ret = bam_read_batch(fp, bb, 4096)) > 0)
+		for (i = 0; i < bb->n; ++i)
+			flagstat_loop(s, &bb->b[i].core);
+	for (i = 0; ret < 0 && i < bb->n; ++i) // alignments read before an error
+		flagstat_loop(s, &bb->b[i].core);
+	bam_batch_destroy(bb);
+	if (ret != 0)
 		fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
 	return s;
 }
@@ -51,12 +52,19 @@ int bam_flagstat(int argc, char *argv[])
 	bamFile fp;
 	bam_header_t *header;
 	bam_flagstat_t *s;
+	int c, n_threads = 1;
+	while ((c = getopt(argc, argv, "@:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		}
+	}
 	if (argc == optind) {
-		fprintf(stderr, "Usage: samtools flagstat <in.bam>\n");
+		fprintf(stderr, "Usage: samtools flagstat [-@ nThreads] <in.bam>\n");
 		return 1;
 	}
 	fp = strcmp(argv[optind], "-")? bam_open(argv[optind], "r") : bam_dopen(fileno(stdin), "r");
 	assert(fp);
+	if (n_threads > 1) bgzf_mt(fp, n_threads, 256);
 	header = bam_header_read(fp);
 	s = bam_flagstat_core(fp);
 	printf("%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
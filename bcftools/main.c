@@ -31,9 +31,9 @@ int bcf_cat(int n, char * const *fn)
 #ifdef _USE_KNETFILE
 		fstat(knet_fileno(in->fp->x.fpr), &s);
 		end = s.st_size - 28;
-		while (knet_tell(in->fp->x.fpr) < end) {
-			int size = knet_tell(in->fp->x.fpr) + BUF_SIZE < end? BUF_SIZE : end - knet_tell(in->fp->x.fpr);
-			knet_read(in->fp->x.fpr, buf, size);
+		while (bgzf_next_address(in->fp) < end) {
+			int size = bgzf_next_address(in->fp) + BUF_SIZE < end? BUF_SIZE : end - bgzf_next_address(in->fp);
+			if (bgzf_raw_read(in->fp, buf, size) != size) break;
 			fwrite(buf, 1, size, out->fp->x.fpw);
 		}
 #else
@@ -96,6 +96,17 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end)
 	return bed_overlap_core(&kh_val(h, k), beg, end);
 }
 
+// the regions on chr as beg<<32|end, sorted; NULL if there are none
+const uint64_t *bed_get(const void *_h, const char *chr, int *n)
+{
+	const reghash_t *h = (const reghash_t*)_h;
+	khint_t k;
+	*n = 0;
+	if (!h || (k = kh_get(reg, h, chr)) == kh_end(h)) return 0;
+	*n = kh_val(h, k).n;
+	return kh_val(h, k).a;
+}
+
 void *bed_read(const char *fn)
 {
 	reghash_t *h = kh_init(reg);
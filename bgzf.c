@@ -33,15 +33,30 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#if !defined(_WIN32) && !defined(BGZF_NO_MMAP)
+#define BGZF_MMAP
+#include <sys/mman.h>
+#endif
 #include "bgzf.h"
 
 #include "khash.h"
-typedef struct {
+typedef struct cache_s {
 	int size;
 	uint8_t *block;
-	int64_t end_offset;
+	int64_t addr, end_offset;
+	struct cache_s *prev, *next; // LRU list; the head is the most recently used
 } cache_t;
-KHASH_MAP_INIT_INT64(cache, cache_t)
+KHASH_MAP_INIT_INT64(cache, cache_t*)
+
+typedef struct {
+	khash_t(cache) *h;
+	cache_t *head, *tail;
+	int64_t max_size, cur_size; // total uncompressed bytes allowed and held
+	uint64_t n_hits, n_misses;
+	int ref; // number of BGZF handles using this cache
+	pthread_mutex_t lock;
+} bgzf_cache_t;
 
 #if defined(_WIN32) || defined(_MSC_VER)
 #define ftello(fp) ftell(fp)
@@ -55,6 +70,8 @@ typedef int8_t bgzf_byte_t;
 
 static const int DEFAULT_BLOCK_SIZE = 64 * 1024;
 static const int MAX_BLOCK_SIZE = 64 * 1024;
+// in the multi-threaded mode, a deflated block must always fit in MAX_BLOCK_SIZE
+static const int MT_BLOCK_SIZE = 0xff00;
 
 static const int BLOCK_HEADER_LENGTH = 18;
 static const int BLOCK_FOOTER_LENGTH = 8;
@@ -137,6 +154,139 @@ int bgzf_check_bgzf(const char *fn)
     return 0;
 }
 
+/* zlib streams are allocated once per BGZF handle (and per worker thread)
+ * and reset between blocks; setting up a deflate stream costs ~256KB of
+ * allocation, which is as expensive as compressing a small block. */
+static z_stream *zs_init(int is_write, int level)
+{
+	z_stream *zs = (z_stream*)calloc(1, sizeof(z_stream));
+	int status = is_write? deflateInit2(zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+		: inflateInit2(zs, GZIP_WINDOW_BITS);
+	if (status != Z_OK) {
+		free(zs);
+		return 0;
+	}
+	return zs;
+}
+
+static void zs_destroy(z_stream *zs, int is_write)
+{
+	if (zs == 0) return;
+	if (is_write) deflateEnd(zs);
+	else inflateEnd(zs);
+	free(zs);
+}
+
+/* Regular local files opened for reading are memory-mapped, and blocks
+ * are inflated straight from the mapping without going through read(2)
+ * or stdio. The mapping is advised for sequential access until the first
+ * seek; after that it is advised for random access, and a window ahead
+ * of the current block is prefetched explicitly. Compile with
+ * -DBGZF_NO_MMAP to disable. */
+#define MM_RA_SIZE 0x40000
+
+typedef struct {
+	uint8_t *base;
+	int64_t size, pos, ra_end; // ra_end: end of the prefetched window in the random mode
+	int is_random;
+} mmaux_t;
+
+#ifdef BGZF_MMAP
+static void mm_init(BGZF *fp, int fd)
+{
+	struct stat st;
+	mmaux_t *mm;
+	void *base;
+	off_t pos;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+	if ((uint64_t)st.st_size != (size_t)st.st_size) return; // too large for the address space
+	if ((pos = lseek(fd, 0, SEEK_CUR)) < 0 || pos > st.st_size) return;
+	base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) return;
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+	mm = (mmaux_t*)calloc(1, sizeof(mmaux_t));
+	mm->base = (uint8_t*)base;
+	mm->size = st.st_size;
+	mm->pos = pos;
+	fp->mm = mm;
+}
+
+static void mm_destroy(mmaux_t *mm)
+{
+	munmap(mm->base, mm->size);
+	free(mm);
+}
+
+// called on seek: switch to the random mode and drop the prefetched window
+static void mm_set_random(mmaux_t *mm)
+{
+	if (!mm->is_random) {
+		madvise(mm->base, mm->size, MADV_RANDOM);
+		mm->is_random = 1;
+	}
+	mm->ra_end = 0;
+}
+
+// prefetch a window ahead of [mm->pos, mm->pos+len) in the random mode
+static void mm_prefetch(mmaux_t *mm, int len)
+{
+	int64_t beg, end;
+	long page = sysconf(_SC_PAGESIZE);
+	if (!mm->is_random || mm->pos + len <= mm->ra_end) return;
+	beg = mm->pos / page * page;
+	end = mm->pos + MM_RA_SIZE < mm->size? mm->pos + MM_RA_SIZE : mm->size;
+	madvise(mm->base + beg, end - beg, MADV_WILLNEED);
+	mm->ra_end = end;
+}
+#else
+#define mm_init(fp, fd)
+#define mm_destroy(mm)
+#define mm_set_random(mm)
+#define mm_prefetch(mm, len)
+#endif
+
+static inline int64_t raw_tell(BGZF *fp)
+{
+	if (fp->mm) return ((mmaux_t*)fp->mm)->pos;
+#ifdef _USE_KNETFILE
+	return fp->open_mode == 'w'? ftello(fp->x.fpw) : knet_tell(fp->x.fpr);
+#else
+	return ftello(fp->file);
+#endif
+}
+
+// read up to len bytes from the underlying file; return the number of bytes read
+static int raw_read(BGZF *fp, void *buf, int len)
+{
+	if (fp->mm) {
+		mmaux_t *mm = (mmaux_t*)fp->mm;
+		if (len > mm->size - mm->pos) len = mm->size - mm->pos;
+		memcpy(buf, mm->base + mm->pos, len);
+		mm->pos += len;
+		return len;
+	}
+#ifdef _USE_KNETFILE
+	return knet_read(fp->x.fpr, buf, len);
+#else
+	return fread(buf, 1, len, fp->file);
+#endif
+}
+
+static int raw_seek(BGZF *fp, int64_t pos)
+{
+	if (fp->mm) {
+		mmaux_t *mm = (mmaux_t*)fp->mm;
+		if (pos < 0 || pos > mm->size) return -1;
+		mm->pos = pos;
+		return 0;
+	}
+#ifdef _USE_KNETFILE
+	return knet_seek(fp->x.fpr, pos, SEEK_SET) == 0? 0 : -1;
+#else
+	return fseeko(fp->file, pos, SEEK_SET) == 0? 0 : -1;
+#endif
+}
+
 static BGZF *bgzf_read_init()
 {
 	BGZF *fp;
@@ -145,8 +295,7 @@ static BGZF *bgzf_read_init()
     fp->uncompressed_block = malloc(MAX_BLOCK_SIZE);
     fp->compressed_block_size = MAX_BLOCK_SIZE;
     fp->compressed_block = malloc(MAX_BLOCK_SIZE);
-	fp->cache_size = 0;
-	fp->cache = kh_init(cache);
+	fp->zs = zs_init(0, 0);
 	return fp;
 }
 
@@ -169,6 +318,7 @@ open_read(int fd)
 #else
     fp->file = file;
 #endif
+    mm_init(fp, fd);
     return fp;
 }
 
@@ -179,7 +329,7 @@ open_write(int fd, int compress_level) // compress_level==-1 for the default lev
     FILE* file = fdopen(fd, "w");
     BGZF* fp;
 	if (file == 0) return 0;
-	fp = malloc(sizeof(BGZF));
+	fp = calloc(1, sizeof(BGZF));
     fp->file_descriptor = fd;
     fp->open_mode = 'w';
     fp->owned_file = 0;
@@ -198,6 +348,7 @@ open_write(int fd, int compress_level) // compress_level==-1 for the default lev
     fp->block_offset = 0;
     fp->block_length = 0;
     fp->error = NULL;
+    fp->zs = zs_init(1, fp->compress_level);
     return fp;
 }
 
@@ -213,6 +364,7 @@ bgzf_open(const char* __restrict path, const char* __restrict mode)
 		fp->file_descriptor = -1;
 		fp->open_mode = 'r';
 		fp->x.fpr = file;
+		if (file->type == KNF_TYPE_LOCAL) mm_init(fp, knet_fileno(file));
 #else
 		int fd, oflag = O_RDONLY;
 #ifdef _WIN32
@@ -260,16 +412,8 @@ bgzf_fdopen(int fd, const char * __restrict mode)
     }
 }
 
-static
-int
-deflate_block(BGZF* fp, int block_length)
+static void pack_header(bgzf_byte_t *buffer)
 {
-    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
-    // Also adds an extra field that stores the compressed block length.
-
-    bgzf_byte_t* buffer = fp->compressed_block;
-    int buffer_size = fp->compressed_block_size;
-
     // Init gzip header
     buffer[0] = GZIP_ID1;
     buffer[1] = GZIP_ID2;
@@ -289,63 +433,60 @@ deflate_block(BGZF* fp, int block_length)
     buffer[15] = 0;
     buffer[16] = 0; // placeholder for block length
     buffer[17] = 0;
+}
+
+/* Deflate src[0..slen) into a complete BGZF block in dst; *dlen is the
+ * capacity of dst on input and the block length on output. Return 0 on
+ * success, 1 if the block does not fit in dst and -1 on zlib errors. */
+static int bgzf_compress(void *_dst, int *dlen, const void *src, int slen, z_stream *zs)
+{
+	int status;
+	uint32_t crc;
+	bgzf_byte_t *dst = (bgzf_byte_t*)_dst;
+	if (deflateReset(zs) != Z_OK) return -1;
+	pack_header(dst);
+	zs->next_in = (Bytef*)src;
+	zs->avail_in = slen;
+	zs->next_out = (Bytef*)dst + BLOCK_HEADER_LENGTH;
+	zs->avail_out = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+	status = deflate(zs, Z_FINISH);
+	if (status != Z_STREAM_END) return status == Z_OK? 1 : -1;
+	*dlen = zs->total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+	packInt16((uint8_t*)&dst[16], *dlen - 1);
+	crc = crc32(crc32(0L, NULL, 0L), src, slen);
+	packInt32((uint8_t*)&dst[*dlen - 8], crc);
+	packInt32((uint8_t*)&dst[*dlen - 4], slen);
+	return 0;
+}
+
+static
+int
+deflate_block(BGZF* fp, int block_length)
+{
+    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
+    // Also adds an extra field that stores the compressed block length.
 
-    // loop to retry for blocks that do not compress enough
     int input_length = block_length;
-    int compressed_length = 0;
-    while (1) {
-        z_stream zs;
-        zs.zalloc = NULL;
-        zs.zfree = NULL;
-        zs.next_in = fp->uncompressed_block;
-        zs.avail_in = input_length;
-        zs.next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
-        zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-
-        int status = deflateInit2(&zs, fp->compress_level, Z_DEFLATED,
-                                  GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-        if (status != Z_OK) {
-            report_error(fp, "deflate init failed");
-            return -1;
-        }
-        status = deflate(&zs, Z_FINISH);
-        if (status != Z_STREAM_END) {
-            deflateEnd(&zs);
-            if (status == Z_OK) {
-                // Not enough space in buffer.
-                // Can happen in the rare case the input doesn't compress enough.
-                // Reduce the amount of input until it fits.
-                input_length -= 1024;
-                if (input_length <= 0) {
-                    // should never happen
-                    report_error(fp, "input reduction failed");
-                    return -1;
-                }
-                continue;
-            }
-            report_error(fp, "deflate failed");
-            return -1;
-        }
-        status = deflateEnd(&zs);
-        if (status != Z_OK) {
-            report_error(fp, "deflate end failed");
-            return -1;
-        }
-        compressed_length = zs.total_out;
-        compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
-        if (compressed_length > MAX_BLOCK_SIZE) {
+    int compressed_length = fp->compressed_block_size;
+    int ret;
+
+    // loop to retry for blocks that do not compress enough
+    while ((ret = bgzf_compress(fp->compressed_block, &compressed_length, fp->uncompressed_block, input_length, fp->zs)) == 1) {
+        // Not enough space in buffer.
+        // Can happen in the rare case the input doesn't compress enough.
+        // Reduce the amount of input until it fits.
+        input_length -= 1024;
+        if (input_length <= 0) {
             // should never happen
-            report_error(fp, "deflate overflow");
+            report_error(fp, "input reduction failed");
             return -1;
         }
-        break;
+        compressed_length = fp->compressed_block_size;
+    }
+    if (ret != 0) {
+        report_error(fp, "deflate failed");
+        return -1;
     }
-
-    packInt16((uint8_t*)&buffer[16], compressed_length-1);
-    uint32_t crc = crc32(0L, NULL, 0L);
-    crc = crc32(crc, fp->uncompressed_block, input_length);
-    packInt32((uint8_t*)&buffer[compressed_length-8], crc);
-    packInt32((uint8_t*)&buffer[compressed_length-4], input_length);
 
     int remaining = block_length - input_length;
     if (remaining > 0) {
@@ -362,38 +503,26 @@ deflate_block(BGZF* fp, int block_length)
     return compressed_length;
 }
 
+// Inflate a complete BGZF block src[0..block_length) into dst; return the uncompressed size or -1
+static int bgzf_uncompress(void *dst, int dlen, const void *src, int block_length, z_stream *zs)
+{
+    if (inflateReset(zs) != Z_OK) return -1;
+    zs->next_in = (Bytef*)src + 18;
+    zs->avail_in = block_length - 16;
+    zs->next_out = (Bytef*)dst;
+    zs->avail_out = dlen;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+    return zs->total_out;
+}
+
 static
 int
 inflate_block(BGZF* fp, int block_length)
 {
     // Inflate the block in fp->compressed_block into fp->uncompressed_block
-
-    z_stream zs;
-	int status;
-    zs.zalloc = NULL;
-    zs.zfree = NULL;
-    zs.next_in = fp->compressed_block + 18;
-    zs.avail_in = block_length - 16;
-    zs.next_out = fp->uncompressed_block;
-    zs.avail_out = fp->uncompressed_block_size;
-
-    status = inflateInit2(&zs, GZIP_WINDOW_BITS);
-    if (status != Z_OK) {
-        report_error(fp, "inflate init failed");
-        return -1;
-    }
-    status = inflate(&zs, Z_FINISH);
-    if (status != Z_STREAM_END) {
-        inflateEnd(&zs);
-        report_error(fp, "inflate failed");
-        return -1;
-    }
-    status = inflateEnd(&zs);
-    if (status != Z_OK) {
-        report_error(fp, "inflate failed");
-        return -1;
-    }
-    return zs.total_out;
+    int ret = bgzf_uncompress(fp->uncompressed_block, fp->uncompressed_block_size, fp->compressed_block, block_length, fp->zs);
+    if (ret < 0) report_error(fp, "inflate failed");
+    return ret;
 }
 
 static
@@ -410,34 +539,404 @@ check_header(const bgzf_byte_t* header)
             unpackInt16((uint8_t*)&header[14]) == BGZF_LEN);
 }
 
+/* When offsets are tracked, every block gets the position of its first
+ * byte in the uncompressed stream as soon as its content is fixed, and
+ * its file offset once it is written. Both happen in the file order, so
+ * the blocks written are always a prefix of those queued. */
+typedef struct {
+	int64_t u_end; // position right after the last block queued
+	int n, n_addr, m;
+	int64_t *u, *addr; // block i holds positions [u[i],u[i+1]); addr[i] is valid for i<n_addr
+} otrack_t;
+
+// a block holding len uncompressed bytes has been queued for writing
+static void track_block(BGZF *fp, int len)
+{
+	otrack_t *t = (otrack_t*)fp->otrack;
+	if (t == 0) return;
+	if (t->n == t->m) {
+		t->m = t->m? t->m<<1 : 256;
+		t->u = (int64_t*)realloc(t->u, t->m * 8);
+		t->addr = (int64_t*)realloc(t->addr, t->m * 8);
+	}
+	t->u[t->n++] = t->u_end;
+	t->u_end += len;
+}
+
+// the next queued block is about to be written at fp->block_address
+static inline void track_write(BGZF *fp)
+{
+	otrack_t *t = (otrack_t*)fp->otrack;
+	if (t) t->addr[t->n_addr++] = fp->block_address;
+}
+
+static void track_destroy(otrack_t *t)
+{
+	if (t == 0) return;
+	free(t->u); free(t->addr); free(t);
+}
+
+/* A handle opened by bgzf_mem_open() appends its compressed blocks to a
+ * growing buffer instead of a file; all writes of compressed data go
+ * through raw_write(). */
+typedef struct {
+	int64_t l, m;
+	uint8_t *s;
+} membuf_t;
+
+static int raw_write(BGZF *fp, const void *data, int64_t len)
+{
+	if (fp->mem) {
+		membuf_t *mb = (membuf_t*)fp->mem;
+		if (mb->l + len > mb->m) {
+			mb->m = mb->l + len;
+			mb->m += mb->m>>1;
+			mb->s = (uint8_t*)realloc(mb->s, mb->m);
+		}
+		memcpy(mb->s + mb->l, data, len);
+		mb->l += len;
+		return 0;
+	}
+#ifdef _USE_KNETFILE
+	if (fwrite(data, 1, len, fp->x.fpw) != len) {
+#else
+	if (fwrite(data, 1, len, fp->file) != len) {
+#endif
+		report_error(fp, "write failed");
+		return -1;
+	}
+	return 0;
+}
+
+/***********************
+ * Multi-threaded BGZF *
+ ***********************/
+
+struct bgzf_mtaux_t;
+
+typedef struct {
+	struct bgzf_mtaux_t *mt;
+	void *buf; // scratch space of MAX_BLOCK_SIZE bytes, swapped with the block it processes
+	z_stream *zs;
+	int i, errcode, toproc;
+} worker_t;
+
+/* When writing, blk[i] holds len[i] bytes of uncompressed data until
+ * mt_flush() deflates it in place. When reading, mt_fill() loads up to
+ * n_blks raw blocks starting at file offset addr[0]; the workers inflate
+ * them in place, and mt_read_block() hands them out from blk[i_read]. */
+typedef struct bgzf_mtaux_t {
+	int n_threads, n_blks, curr, done, proc_cnt;
+	int is_write;
+	void **blk;
+	int *len;
+	int64_t *addr; // reading only: addr[i] is the file offset of blk[i]; addr[curr] is where the next batch starts
+	const char *error; // reading only: error met after the blocks of the current batch, reported once they are used
+	int i_read;
+	worker_t *w;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv, done_cv;
+} mtaux_t;
+
+// process blocks w->i, w->i+n_threads, ... in place
+static void worker_run(worker_t *w)
+{
+	mtaux_t *mt = w->mt;
+	int i;
+	void *tmp;
+	w->errcode = 0;
+	for (i = w->i; i < mt->curr; i += mt->n_threads) {
+		int len = MAX_BLOCK_SIZE;
+		if (mt->is_write) {
+			if (bgzf_compress(w->buf, &len, mt->blk[i], mt->len[i], w->zs) != 0) len = -1;
+		} else len = bgzf_uncompress(w->buf, MAX_BLOCK_SIZE, mt->blk[i], mt->len[i], w->zs);
+		if (len < 0) {
+			w->errcode = 1;
+			continue;
+		}
+		tmp = mt->blk[i]; mt->blk[i] = w->buf; w->buf = tmp;
+		mt->len[i] = len;
+	}
+	pthread_mutex_lock(&mt->lock);
+	if (++mt->proc_cnt == mt->n_threads) pthread_cond_signal(&mt->done_cv);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+static void *mt_worker(void *data)
+{
+	worker_t *w = (worker_t*)data;
+	mtaux_t *mt = w->mt;
+	for (;;) {
+		pthread_mutex_lock(&mt->lock);
+		while (!w->toproc && !mt->done)
+			pthread_cond_wait(&mt->cv, &mt->lock);
+		if (mt->done) {
+			pthread_mutex_unlock(&mt->lock);
+			break;
+		}
+		w->toproc = 0;
+		pthread_mutex_unlock(&mt->lock);
+		worker_run(w);
+	}
+	return 0;
+}
+
+// let all threads process the first mt->curr blocks; return non-zero if any block failed
+static int mt_process(mtaux_t *mt)
+{
+	int i, errcode = 0;
+	// signal all the workers to compute
+	pthread_mutex_lock(&mt->lock);
+	for (i = 1; i < mt->n_threads; ++i) mt->w[i].toproc = 1;
+	mt->proc_cnt = 0;
+	pthread_cond_broadcast(&mt->cv);
+	pthread_mutex_unlock(&mt->lock);
+	// worker 0 is doing things here
+	worker_run(&mt->w[0]);
+	// wait for all the threads to complete
+	pthread_mutex_lock(&mt->lock);
+	while (mt->proc_cnt < mt->n_threads)
+		pthread_cond_wait(&mt->done_cv, &mt->lock);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->n_threads; ++i) errcode |= mt->w[i].errcode;
+	return errcode;
+}
+
+int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
+{
+	int i;
+	mtaux_t *mt;
+	if (fp->mt || n_threads <= 1) return -1;
+	if (n_sub_blks <= 0) n_sub_blks = 1;
+	if (fp->open_mode == 'w' && bgzf_flush(fp) != 0) return -1; // the pending block may be larger than MT_BLOCK_SIZE
+	mt = (mtaux_t*)calloc(1, sizeof(mtaux_t));
+	mt->n_threads = n_threads;
+	mt->n_blks = n_threads * n_sub_blks;
+	mt->is_write = (fp->open_mode == 'w');
+	mt->len = (int*)calloc(mt->n_blks, sizeof(int));
+	mt->blk = (void**)calloc(mt->n_blks, sizeof(void*));
+	for (i = 0; i < mt->n_blks; ++i)
+		mt->blk[i] = malloc(MAX_BLOCK_SIZE);
+	if (!mt->is_write) {
+		mt->addr = (int64_t*)calloc(mt->n_blks + 1, 8);
+		mt->addr[0] = raw_tell(fp);
+	}
+	mt->tid = (pthread_t*)calloc(mt->n_threads, sizeof(pthread_t)); // tid[0] is not used; worker 0 is the calling thread
+	mt->w = (worker_t*)calloc(mt->n_threads, sizeof(worker_t));
+	for (i = 0; i < mt->n_threads; ++i) {
+		mt->w[i].i = i;
+		mt->w[i].mt = mt;
+		mt->w[i].buf = malloc(MAX_BLOCK_SIZE);
+		mt->w[i].zs = i? zs_init(mt->is_write, fp->compress_level) : fp->zs; // worker 0 shares the stream of fp
+	}
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cv, 0);
+	pthread_cond_init(&mt->done_cv, 0);
+	for (i = 1; i < mt->n_threads; ++i)
+		pthread_create(&mt->tid[i], 0, mt_worker, &mt->w[i]);
+	fp->mt = mt;
+	if (mt->is_write) fp->uncompressed_block_size = MT_BLOCK_SIZE;
+	return 0;
+}
+
+static void mt_destroy(mtaux_t *mt)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->done = 1;
+	pthread_cond_broadcast(&mt->cv);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 1; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
+	for (i = 0; i < mt->n_blks; ++i) free(mt->blk[i]);
+	for (i = 0; i < mt->n_threads; ++i) free(mt->w[i].buf);
+	for (i = 1; i < mt->n_threads; ++i) zs_destroy(mt->w[i].zs, mt->is_write);
+	free(mt->blk); free(mt->len); free(mt->addr); free(mt->w); free(mt->tid);
+	pthread_cond_destroy(&mt->cv);
+	pthread_cond_destroy(&mt->done_cv);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+// compress all queued blocks in parallel and write them in order
+static int mt_flush(BGZF *fp)
+{
+	int i;
+	mtaux_t *mt = (mtaux_t*)fp->mt;
+	if (mt->curr == 0) return 0;
+	if (mt_process(mt) != 0) {
+		report_error(fp, "deflate failed");
+		return -1;
+	}
+	// dump data to disk
+	for (i = 0; i < mt->curr; ++i) {
+		track_write(fp);
+		if (raw_write(fp, mt->blk[i], mt->len[i]) != 0) return -1;
+		fp->block_address += mt->len[i];
+	}
+	mt->curr = 0;
+	return 0;
+}
+
+// queue the current block; compression is deferred until the queue is full
+static int mt_lazy_flush(BGZF *fp)
+{
+	mtaux_t *mt = (mtaux_t*)fp->mt;
+	if (fp->block_offset == 0) return 0;
+	memcpy(mt->blk[mt->curr], fp->uncompressed_block, fp->block_offset);
+	mt->len[mt->curr] = fp->block_offset;
+	track_block(fp, fp->block_offset);
+	fp->block_offset = 0;
+	if (++mt->curr == mt->n_blks) return mt_flush(fp);
+	return 0;
+}
+
+// read the next n_blks raw blocks and inflate them in parallel
+static int mt_fill(BGZF *fp)
+{
+	mtaux_t *mt = (mtaux_t*)fp->mt;
+	int64_t addr = mt->addr[mt->curr];
+	mt->i_read = mt->curr = 0;
+	mt->addr[0] = addr;
+	if (mt->error) { // deferred from the previous batch
+		report_error(fp, mt->error);
+		return -1;
+	}
+	while (mt->curr < mt->n_blks) {
+		bgzf_byte_t *blk = (bgzf_byte_t*)mt->blk[mt->curr];
+		int count, block_length;
+		count = raw_read(fp, blk, BLOCK_HEADER_LENGTH);
+		if (count == 0) break;
+		if (count != BLOCK_HEADER_LENGTH) {
+			mt->error = "read failed";
+			break;
+		}
+		if (!check_header(blk)) {
+			mt->error = "invalid block header";
+			break;
+		}
+		block_length = unpackInt16((uint8_t*)&blk[16]) + 1;
+		count = raw_read(fp, &blk[BLOCK_HEADER_LENGTH], block_length - BLOCK_HEADER_LENGTH);
+		if (count != block_length - BLOCK_HEADER_LENGTH) {
+			mt->error = "read failed";
+			break;
+		}
+		mt->len[mt->curr] = block_length;
+		addr += block_length;
+		mt->addr[++mt->curr] = addr;
+	}
+	if (mt->curr == 0 && mt->error) { // nothing to serve before the error
+		report_error(fp, mt->error);
+		return -1;
+	}
+	if (mt->curr && mt_process(mt) != 0) {
+		mt->curr = 0;
+		report_error(fp, "inflate failed");
+		return -1;
+	}
+	return 0;
+}
+
+// serve the next read-ahead block, loading a new batch when the current one is used up
+static int mt_read_block(BGZF *fp)
+{
+	mtaux_t *mt = (mtaux_t*)fp->mt;
+	void *tmp;
+	if (mt->i_read == mt->curr && mt_fill(fp) != 0) return -1;
+	if (mt->curr == 0) {
+		fp->block_length = 0;
+		return 0;
+	}
+	tmp = fp->uncompressed_block;
+	fp->uncompressed_block = mt->blk[mt->i_read];
+	mt->blk[mt->i_read] = tmp;
+	if (fp->block_length != 0) fp->block_offset = 0; // do not reset offset if this read follows a seek
+	fp->block_address = mt->addr[mt->i_read];
+	fp->block_length = mt->len[mt->i_read];
+	++mt->i_read;
+	return 0;
+}
+
+int64_t bgzf_next_address(BGZF *fp)
+{
+	if (fp->mt && fp->open_mode == 'r') {
+		mtaux_t *mt = (mtaux_t*)fp->mt;
+		return mt->addr[mt->i_read];
+	}
+	return raw_tell(fp);
+}
+
+/* The block cache is keyed by the file offset of a block and evicts the
+ * least recently used block once the total uncompressed size exceeds the
+ * limit. It may be shared by several handles opened on the same file, so
+ * all accesses are made under the lock. */
+static inline void lru_unlink(bgzf_cache_t *c, cache_t *p)
+{
+	if (p->prev) p->prev->next = p->next;
+	else c->head = p->next;
+	if (p->next) p->next->prev = p->prev;
+	else c->tail = p->prev;
+	p->prev = p->next = 0;
+}
+
+static inline void lru_push(bgzf_cache_t *c, cache_t *p)
+{
+	p->prev = 0; p->next = c->head;
+	if (c->head) c->head->prev = p;
+	else c->tail = p;
+	c->head = p;
+}
+
 static void free_cache(BGZF *fp)
 {
-	khint_t k;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	if (fp->open_mode != 'r') return;
-	for (k = kh_begin(h); k < kh_end(h); ++k)
-		if (kh_exist(h, k)) free(kh_val(h, k).block);
-	kh_destroy(cache, h);
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	cache_t *p, *q;
+	if (c == 0) return;
+	fp->cache = 0;
+	pthread_mutex_lock(&c->lock);
+	if (--c->ref > 0) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	pthread_mutex_unlock(&c->lock);
+	for (p = c->head; p; p = q) {
+		q = p->next;
+		free(p->block); free(p);
+	}
+	kh_destroy(cache, c->h);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
 }
 
 static int load_block_from_cache(BGZF *fp, int64_t block_address)
 {
 	khint_t k;
 	cache_t *p;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	k = kh_get(cache, h, block_address);
-	if (k == kh_end(h)) return 0;
-	p = &kh_val(h, k);
+	int64_t end_offset;
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	if (c == 0) return 0;
+	pthread_mutex_lock(&c->lock);
+	if (c->max_size == 0) { // disabled by bgzf_set_cache_size()
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	k = kh_get(cache, c->h, block_address);
+	if (k == kh_end(c->h)) {
+		++c->n_misses;
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	++c->n_hits;
+	p = kh_val(c->h, k);
+	if (p != c->head) lru_unlink(c, p), lru_push(c, p);
 	if (fp->block_length != 0) fp->block_offset = 0;
 	fp->block_address = block_address;
 	fp->block_length = p->size;
-	memcpy(fp->uncompressed_block, p->block, MAX_BLOCK_SIZE);
-#ifdef _USE_KNETFILE
-	knet_seek(fp->x.fpr, p->end_offset, SEEK_SET);
-#else
-	fseeko(fp->file, p->end_offset, SEEK_SET);
-#endif
-	return p->size;
+	memcpy(fp->uncompressed_block, p->block, p->size);
+	end_offset = p->end_offset;
+	pthread_mutex_unlock(&c->lock);
+	raw_seek(fp, end_offset);
+	return fp->block_length;
 }
 
 static void cache_block(BGZF *fp, int size)
@@ -445,26 +944,68 @@ static void cache_block(BGZF *fp, int size)
 	int ret;
 	khint_t k;
 	cache_t *p;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	if (MAX_BLOCK_SIZE >= fp->cache_size) return;
-	if ((kh_size(h) + 1) * MAX_BLOCK_SIZE > fp->cache_size) {
-		/* A better way would be to remove the oldest block in the
-		 * cache, but here we remove a random one for simplicity. This
-		 * should not have a big impact on performance. */
-		for (k = kh_begin(h); k < kh_end(h); ++k)
-			if (kh_exist(h, k)) break;
-		if (k < kh_end(h)) {
-			free(kh_val(h, k).block);
-			kh_del(cache, h, k);
-		}
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	if (c == 0 || fp->block_length == 0 || fp->block_length > c->max_size) return;
+	pthread_mutex_lock(&c->lock);
+	k = kh_put(cache, c->h, fp->block_address, &ret);
+	if (ret == 0) { // another handle sharing the cache has added this block
+		pthread_mutex_unlock(&c->lock);
+		return;
 	}
-	k = kh_put(cache, h, fp->block_address, &ret);
-	if (ret == 0) return; // if this happens, a bug!
-	p = &kh_val(h, k);
+	while (c->tail && c->cur_size + fp->block_length > c->max_size) { // evict the least recently used blocks
+		cache_t *q = c->tail;
+		lru_unlink(c, q);
+		kh_del(cache, c->h, kh_get(cache, c->h, q->addr));
+		c->cur_size -= q->size;
+		free(q->block); free(q);
+	}
+	p = (cache_t*)malloc(sizeof(cache_t));
 	p->size = fp->block_length;
+	p->addr = fp->block_address;
 	p->end_offset = fp->block_address + size;
-	p->block = malloc(MAX_BLOCK_SIZE);
-	memcpy(kh_val(h, k).block, fp->uncompressed_block, MAX_BLOCK_SIZE);
+	p->block = (uint8_t*)malloc(p->size);
+	memcpy(p->block, fp->uncompressed_block, p->size);
+	kh_val(c->h, k) = p;
+	lru_push(c, p);
+	c->cur_size += p->size;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// inflate the next block directly from the mapped file
+static int mm_read_block(BGZF *fp, int64_t block_address)
+{
+	mmaux_t *mm = (mmaux_t*)fp->mm;
+	const bgzf_byte_t *src = (const bgzf_byte_t*)mm->base + mm->pos;
+	int count, block_length;
+	if (mm->pos == mm->size) {
+		fp->block_length = 0;
+		return 0;
+	}
+	if (mm->size - mm->pos < BLOCK_HEADER_LENGTH) {
+		report_error(fp, "read failed");
+		return -1;
+	}
+	if (!check_header(src)) {
+		report_error(fp, "invalid block header");
+		return -1;
+	}
+	block_length = unpackInt16((uint8_t*)&src[16]) + 1;
+	if (block_length > mm->size - mm->pos) {
+		report_error(fp, "read failed");
+		return -1;
+	}
+	mm_prefetch(mm, block_length);
+	count = bgzf_uncompress(fp->uncompressed_block, fp->uncompressed_block_size, src, block_length, fp->zs);
+	if (count < 0) {
+		report_error(fp, "inflate failed");
+		return -1;
+	}
+	mm->pos += block_length;
+	if (fp->block_length != 0) fp->block_offset = 0; // do not reset offset if this read follows a seek
+	fp->block_address = block_address;
+	fp->block_length = count;
+	cache_block(fp, block_length);
+	return 0;
 }
 
 int
@@ -472,15 +1013,11 @@ bgzf_read_block(BGZF* fp)
 {
     bgzf_byte_t header[BLOCK_HEADER_LENGTH];
 	int count, size = 0, block_length, remaining;
-#ifdef _USE_KNETFILE
-    int64_t block_address = knet_tell(fp->x.fpr);
-	if (load_block_from_cache(fp, block_address)) return 0;
-    count = knet_read(fp->x.fpr, header, sizeof(header));
-#else
-    int64_t block_address = ftello(fp->file);
+	if (fp->mt) return mt_read_block(fp);
+    int64_t block_address = raw_tell(fp);
 	if (load_block_from_cache(fp, block_address)) return 0;
-    count = fread(header, 1, sizeof(header), fp->file);
-#endif
+	if (fp->mm) return mm_read_block(fp, block_address);
+    count = raw_read(fp, header, sizeof(header));
     if (count == 0) {
         fp->block_length = 0;
         return 0;
@@ -498,11 +1035,7 @@ bgzf_read_block(BGZF* fp)
     bgzf_byte_t* compressed_block = (bgzf_byte_t*) fp->compressed_block;
     memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
     remaining = block_length - BLOCK_HEADER_LENGTH;
-#ifdef _USE_KNETFILE
-    count = knet_read(fp->x.fpr, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
-#else
-    count = fread(&compressed_block[BLOCK_HEADER_LENGTH], 1, remaining, fp->file);
-#endif
+    count = raw_read(fp, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
     if (count != remaining) {
         report_error(fp, "read failed");
         return -1;
@@ -553,11 +1086,7 @@ bgzf_read(BGZF* fp, void* data, int length)
         bytes_read += copy_length;
     }
     if (fp->block_offset == fp->block_length) {
-#ifdef _USE_KNETFILE
-        fp->block_address = knet_tell(fp->x.fpr);
-#else
-        fp->block_address = ftello(fp->file);
-#endif
+        fp->block_address = bgzf_next_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -566,19 +1095,14 @@ bgzf_read(BGZF* fp, void* data, int length)
 
 int bgzf_flush(BGZF* fp)
 {
+	if (fp->mt) return mt_lazy_flush(fp);
     while (fp->block_offset > 0) {
-        int count, block_length;
+        int block_length, len = fp->block_offset;
 		block_length = deflate_block(fp, fp->block_offset);
         if (block_length < 0) return -1;
-#ifdef _USE_KNETFILE
-        count = fwrite(fp->compressed_block, 1, block_length, fp->x.fpw);
-#else
-        count = fwrite(fp->compressed_block, 1, block_length, fp->file);
-#endif
-        if (count != block_length) {
-            report_error(fp, "write failed");
-            return -1;
-        }
+		track_block(fp, len - fp->block_offset);
+		track_write(fp);
+		if (raw_write(fp, fp->compressed_block, block_length) != 0) return -1;
         fp->block_address += block_length;
     }
     return 0;
@@ -591,6 +1115,71 @@ int bgzf_flush_try(BGZF *fp, int size)
 	return -1;
 }
 
+int bgzf_raw_read(BGZF *fp, void *buf, int len)
+{
+	if (fp->open_mode != 'r' || fp->mt) return -1;
+	return raw_read(fp, buf, len);
+}
+
+int bgzf_copy_block(BGZF *out, BGZF *fp)
+{
+	const void *raw;
+	int64_t end;
+	int len;
+	if (fp->open_mode != 'r' || out->open_mode != 'w' || (fp->mt && !fp->mm) || fp->cache || fp->block_length == 0)
+		return -1; // the compressed block is not kept in these cases
+	if (bgzf_flush(out) != 0 || (out->mt && mt_flush(out) != 0)) return -1;
+	end = bgzf_next_address(fp);
+	len = end - fp->block_address;
+	raw = fp->mm? ((mmaux_t*)fp->mm)->base + fp->block_address : fp->compressed_block;
+	track_block(out, fp->block_length);
+	track_write(out);
+	if (raw_write(out, raw, len) != 0) return -1;
+	out->block_address += len;
+	fp->block_address = end;
+	fp->block_offset = fp->block_length = 0;
+	return 0;
+}
+
+BGZF *bgzf_mem_open(const char *mode)
+{
+	int i, compress_level = -1;
+	BGZF *fp;
+	for (i = 0; mode[i]; ++i)
+		if (mode[i] >= '0' && mode[i] <= '9') break;
+	if (mode[i]) compress_level = (int)mode[i] - '0';
+	if (strchr(mode, 'u')) compress_level = 0;
+	fp = calloc(1, sizeof(BGZF));
+	fp->file_descriptor = -1;
+	fp->open_mode = 'w';
+	fp->compress_level = compress_level < 0? Z_DEFAULT_COMPRESSION : compress_level;
+	if (fp->compress_level > 9) fp->compress_level = Z_DEFAULT_COMPRESSION;
+	fp->uncompressed_block_size = DEFAULT_BLOCK_SIZE;
+	fp->compressed_block_size = MAX_BLOCK_SIZE;
+	fp->compressed_block = malloc(MAX_BLOCK_SIZE);
+	fp->zs = zs_init(1, fp->compress_level);
+	fp->mem = calloc(1, sizeof(membuf_t));
+	return fp;
+}
+
+int bgzf_mem_take(BGZF *fp, uint8_t **data, int64_t *len)
+{
+	membuf_t *mb = (membuf_t*)fp->mem;
+	if (mb == 0 || bgzf_flush(fp) != 0 || (fp->mt && mt_flush(fp) != 0)) return -1;
+	*data = mb->s, *len = mb->l;
+	mb->s = 0, mb->l = mb->m = 0;
+	return 0;
+}
+
+int bgzf_write_blocks(BGZF *fp, const void *data, int64_t len)
+{
+	if (fp->open_mode != 'w' || fp->otrack) return -1;
+	if (bgzf_flush(fp) != 0 || (fp->mt && mt_flush(fp) != 0)) return -1;
+	if (raw_write(fp, data, len) != 0) return -1;
+	fp->block_address += len;
+	return 0;
+}
+
 int bgzf_write(BGZF* fp, const void* data, int length)
 {
 	const bgzf_byte_t *input = data;
@@ -626,22 +1215,20 @@ int bgzf_close(BGZF* fp)
 {
     if (fp->open_mode == 'w') {
         if (bgzf_flush(fp) != 0) return -1;
-		{ // add an empty block
+		if (fp->mt && mt_flush(fp) != 0) return -1;
+		if (fp->mem == 0) { // add an empty block
 			int count, block_length = deflate_block(fp, 0);
 #ifdef _USE_KNETFILE
 			count = fwrite(fp->compressed_block, 1, block_length, fp->x.fpw);
+			if (fflush(fp->x.fpw) != 0) {
 #else
 			count = fwrite(fp->compressed_block, 1, block_length, fp->file);
+			if (fflush(fp->file) != 0) {
 #endif
+				report_error(fp, "flush failed");
+				return -1;
+			}
 		}
-#ifdef _USE_KNETFILE
-        if (fflush(fp->x.fpw) != 0) {
-#else
-        if (fflush(fp->file) != 0) {
-#endif
-            report_error(fp, "flush failed");
-            return -1;
-        }
     }
     if (fp->owned_file) {
 #ifdef _USE_KNETFILE
@@ -653,6 +1240,14 @@ int bgzf_close(BGZF* fp)
         if (fclose(fp->file) != 0) return -1;
 #endif
     }
+    if (fp->mt) mt_destroy((mtaux_t*)fp->mt);
+    if (fp->mm) mm_destroy((mmaux_t*)fp->mm);
+    track_destroy((otrack_t*)fp->otrack);
+	if (fp->mem) {
+		free(((membuf_t*)fp->mem)->s);
+		free(fp->mem);
+	}
+    zs_destroy(fp->zs, fp->open_mode == 'w');
     free(fp->uncompressed_block);
     free(fp->compressed_block);
 	free_cache(fp);
@@ -662,7 +1257,80 @@ int bgzf_close(BGZF* fp)
 
 void bgzf_set_cache_size(BGZF *fp, int cache_size)
 {
-	if (fp) fp->cache_size = cache_size;
+	bgzf_cache_t *c;
+	if (fp == 0 || fp->open_mode != 'r') return;
+	if (fp->cache == 0) {
+		if (cache_size <= 0) return;
+		c = (bgzf_cache_t*)calloc(1, sizeof(bgzf_cache_t));
+		c->h = kh_init(cache);
+		c->ref = 1;
+		pthread_mutex_init(&c->lock, 0);
+		fp->cache = c;
+	}
+	c = (bgzf_cache_t*)fp->cache;
+	pthread_mutex_lock(&c->lock);
+	c->max_size = cache_size > 0? cache_size : 0; // blocks in excess are evicted when the next block is added
+	pthread_mutex_unlock(&c->lock);
+}
+
+int bgzf_share_cache(BGZF *fp, BGZF *src)
+{
+	bgzf_cache_t *c = src? (bgzf_cache_t*)src->cache : 0;
+	if (fp == 0 || c == 0 || fp->open_mode != 'r') return -1;
+	if (fp->cache == c) return 0;
+	free_cache(fp);
+	pthread_mutex_lock(&c->lock);
+	++c->ref;
+	pthread_mutex_unlock(&c->lock);
+	fp->cache = c;
+	return 0;
+}
+
+void bgzf_cache_stat(const BGZF *fp, uint64_t *n_hits, uint64_t *n_misses)
+{
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	*n_hits = *n_misses = 0;
+	if (c == 0) return;
+	pthread_mutex_lock(&c->lock);
+	*n_hits = c->n_hits, *n_misses = c->n_misses;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int bgzf_track_offsets(BGZF *fp)
+{
+	otrack_t *t;
+	if (fp->open_mode != 'w') return -1;
+	if (fp->otrack) return 0;
+	if (bgzf_flush(fp) != 0 || (fp->mt && mt_flush(fp) != 0)) return -1;
+	t = (otrack_t*)calloc(1, sizeof(otrack_t));
+	t->u_end = fp->block_address + 1; // any positive origin works; only differences matter
+	fp->otrack = t;
+	return 0;
+}
+
+int64_t bgzf_utell(BGZF *fp)
+{
+	otrack_t *t = (otrack_t*)fp->otrack;
+	return t? t->u_end + fp->block_offset : -1;
+}
+
+int64_t bgzf_utov(BGZF *fp, int64_t upos)
+{
+	otrack_t *t = (otrack_t*)fp->otrack;
+	int lo, hi;
+	if (t == 0) return -1;
+	if (upos >= (t->n_addr < t->n? t->u[t->n_addr] : t->u_end)) { // not written yet
+		if (bgzf_flush(fp) != 0 || (fp->mt && mt_flush(fp) != 0)) return -1;
+		if (upos == t->u_end) return fp->block_address << 16; // the start of the next block
+		if (upos > t->u_end) return -1;
+	}
+	if (t->n_addr == 0 || upos < t->u[0]) return -1;
+	for (lo = 0, hi = t->n_addr; hi - lo > 1;) { // find the last block starting at or before upos
+		int mid = (lo + hi) >> 1;
+		if (t->u[mid] <= upos) lo = mid;
+		else hi = mid;
+	}
+	return t->addr[lo] << 16 | (upos - t->u[lo]);
 }
 
 int bgzf_check_EOF(BGZF *fp)
@@ -670,6 +1338,11 @@ int bgzf_check_EOF(BGZF *fp)
 	static uint8_t magic[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
 	uint8_t buf[28];
 	off_t offset;
+	if (fp->mm) {
+		mmaux_t *mm = (mmaux_t*)fp->mm;
+		if (mm->size < 28) return -1;
+		return (memcmp(magic, mm->base + mm->size - 28, 28) == 0)? 1 : 0;
+	}
 #ifdef _USE_KNETFILE
 	offset = knet_tell(fp->x.fpr);
 	if (knet_seek(fp->x.fpr, -28, SEEK_END) != 0) return -1;
@@ -699,14 +1372,17 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     }
     block_offset = pos & 0xFFFF;
     block_address = (pos >> 16) & 0xFFFFFFFFFFFFLL;
-#ifdef _USE_KNETFILE
-    if (knet_seek(fp->x.fpr, block_address, SEEK_SET) != 0) {
-#else
-    if (fseeko(fp->file, block_address, SEEK_SET) != 0) {
-#endif
+    if (raw_seek(fp, block_address) != 0) {
         report_error(fp, "seek failed");
         return -1;
     }
+    if (fp->mm) mm_set_random((mmaux_t*)fp->mm);
+    if (fp->mt) { // discard the read-ahead blocks
+        mtaux_t *mt = (mtaux_t*)fp->mt;
+        mt->i_read = mt->curr = 0;
+        mt->addr[0] = block_address;
+        mt->error = 0;
+    }
     fp->block_length = 0;  // indicates current block is not loaded
     fp->block_address = block_address;
     fp->block_offset = block_offset;
@@ -52,9 +52,14 @@ typedef struct {
     int64_t block_address;
     int block_length;
     int block_offset;
-	int cache_size;
     const char* error;
-	void *cache; // a pointer to a hash table
+	void *cache; // LRU block cache, possibly shared with other handles; NULL if disabled
+	void *mt; // multi-threading auxiliary data; NULL in the single-threaded mode
+	z_stream *zs; // zlib stream reused across blocks; deflate when writing and inflate when reading
+	void *mm; // memory-mapped input; NULL if the file is not mapped
+	void *otrack; // file offsets of the blocks written; NULL unless bgzf_track_offsets() is called
+	void *mem; // compressed blocks kept in memory by bgzf_mem_open(); NULL for files
+	void *idx_build; // index built by the caller as data are written; not touched by BGZF
 } BGZF;
 
 #ifdef __cplusplus
@@ -120,10 +125,103 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where);
 /*
  * Set the cache size. Zero to disable. By default, caching is
  * disabled. The recommended cache size for frequent random access is
- * about 8M bytes.
+ * about 8M bytes. The least recently used blocks are evicted first.
+ * If the cache is shared, the size applies to all the sharing handles.
  */
 void bgzf_set_cache_size(BGZF *fp, int cache_size);
 
+/*
+ * Let fp use the block cache of src, which must be opened on the same
+ * file and have a cache. The cache is freed with the last handle using it.
+ * Returns zero on success, -1 if src has no cache.
+ */
+int bgzf_share_cache(BGZF *fp, BGZF *src);
+
+/*
+ * Get the numbers of block loads served from and missed by the cache.
+ */
+void bgzf_cache_stat(const BGZF *fp, uint64_t *n_hits, uint64_t *n_misses);
+
+/*
+ * Use n_threads threads (including the calling thread) for (de)compression.
+ * When writing, filled blocks are queued and, once n_threads*n_sub_blks
+ * blocks are pending, deflated in parallel and written in the original
+ * order. When reading, n_threads*n_sub_blks blocks are read ahead and
+ * inflated in parallel; virtual offsets and bgzf_seek are not affected,
+ * but the block cache is bypassed.
+ * Returns zero on success, -1 if already enabled or n_threads<=1.
+ */
+int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
+
+/*
+ * Return the file offset of the next block to be loaded. This differs
+ * from the position of the underlying file in the multi-threaded mode.
+ */
+int64_t bgzf_next_address(BGZF *fp);
+
+/*
+ * Read up to len bytes of the file as they are stored, starting at the
+ * block following the one currently loaded, for copying the remaining
+ * blocks verbatim. The underlying FILE or knetFile must not be read
+ * directly, as it is not advanced when the file is memory-mapped.
+ * Returns the number of bytes read, or -1 in the multi-threaded mode.
+ */
+int bgzf_raw_read(BGZF *fp, void *buf, int len);
+
+/*
+ * Write the block currently loaded in fp to out as it is stored in the
+ * file, without recompressing it, and move fp past the block. Pending
+ * data in out are flushed first. Returns zero on success, -1 on errors or
+ * if the compressed block is not available (with the block cache or in
+ * the multi-threaded reading mode of a file that is not memory-mapped).
+ */
+int bgzf_copy_block(BGZF *out, BGZF *fp);
+
+/*
+ * Record where each block written from now on starts in the file, so
+ * that positions returned by bgzf_utell can be converted to virtual
+ * offsets by bgzf_utov once the data are compressed. Pending data are
+ * flushed first. Returns zero on success, -1 on errors or if fp is not
+ * open for writing.
+ */
+int bgzf_track_offsets(BGZF *fp);
+
+/*
+ * Return the position of the next byte to write in the uncompressed
+ * stream, or -1 if offsets are not tracked. Positions are positive and
+ * grow with the bytes written. Unlike bgzf_tell, the position is known
+ * before the block is compressed, also in the multi-threaded mode.
+ */
+int64_t bgzf_utell(BGZF *fp);
+
+/*
+ * Convert a position returned by bgzf_utell to a virtual offset. Pending
+ * data are flushed if the position is not in a block written yet.
+ * Returns -1 on errors.
+ */
+int64_t bgzf_utov(BGZF *fp, int64_t upos);
+
+/*
+ * Open a handle that keeps the compressed blocks in memory instead of
+ * writing them to a file. The compression level is read from mode as by
+ * bgzf_open. No EOF marker is added when the handle is closed.
+ */
+BGZF *bgzf_mem_open(const char *mode);
+
+/*
+ * Flush fp opened by bgzf_mem_open and hand over the blocks compressed so
+ * far: *data is set to a malloc()ed buffer of *len bytes that the caller
+ * frees, and fp continues with an empty buffer. Returns zero on success.
+ */
+int bgzf_mem_take(BGZF *fp, uint8_t **data, int64_t *len);
+
+/*
+ * Append complete BGZF blocks, such as those from bgzf_mem_take, to fp as
+ * they are, without recompressing them. Pending data in fp are flushed
+ * first. Returns zero on success, -1 on errors or if offsets are tracked.
+ */
+int bgzf_write_blocks(BGZF *fp, const void *data, int64_t len);
+
 int bgzf_check_EOF(BGZF *fp);
 int bgzf_read_block(BGZF* fp);
 int bgzf_flush(BGZF* fp);
@@ -143,11 +241,7 @@ static inline int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-#ifdef _USE_KNETFILE
-        fp->block_address = knet_tell(fp->x.fpr);
-#else
-        fp->block_address = ftello(fp->file);
-#endif
+        fp->block_address = bgzf_next_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
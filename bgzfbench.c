@@ -0,0 +1,148 @@
+/* This program measures BGZF block throughput: it inflates the blocks of a
+ * BGZF file and deflates its uncompressed data again, once through BGZF,
+ * which reuses one zlib stream per handle, and once setting up and tearing
+ * down a zlib stream for every block, and reports blocks per second.
+ * To compile, run `make bgzfbench'.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "bgzf.h"
+
+#define BLK_SIZE 0x10000
+
+static double realtime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static uint8_t *read_file(const char *fn, int64_t *len)
+{
+	FILE *fp;
+	uint8_t *s = 0;
+	int64_t m = 0;
+	int l;
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	*len = 0;
+	do {
+		if (*len + BLK_SIZE > m) s = realloc(s, m = *len + BLK_SIZE * 16);
+		l = fread(s + *len, 1, BLK_SIZE, fp);
+		*len += l;
+	} while (l > 0);
+	fclose(fp);
+	return s;
+}
+
+// inflate every block, each with its own zlib stream as BGZF used to do
+static int64_t inflate_init_each(const uint8_t *s, int64_t len, uint8_t *buf)
+{
+	int64_t off, n = 0;
+	for (off = 0; off + 18 <= len;) {
+		z_stream zs;
+		int bl = (s[off+16] | s[off+17]<<8) + 1;
+		memset(&zs, 0, sizeof(z_stream));
+		inflateInit2(&zs, -15);
+		zs.next_in = (Bytef*)s + off + 18, zs.avail_in = bl - 16;
+		zs.next_out = buf, zs.avail_out = BLK_SIZE;
+		if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			inflateEnd(&zs);
+			return -1;
+		}
+		if (zs.total_out) ++n; // not the EOF marker
+		inflateEnd(&zs);
+		off += bl;
+	}
+	return n;
+}
+
+// deflate the data in 64KB pieces, each with its own zlib stream
+static int64_t deflate_init_each(const uint8_t *s, int64_t len, uint8_t *buf, int level)
+{
+	int64_t off, n = 0;
+	for (off = 0; off < len; off += BLK_SIZE, ++n) {
+		z_stream zs;
+		memset(&zs, 0, sizeof(z_stream));
+		deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		zs.next_in = (Bytef*)s + off, zs.avail_in = len - off < BLK_SIZE? len - off : BLK_SIZE;
+		zs.next_out = buf, zs.avail_out = BLK_SIZE * 2;
+		deflate(&zs, Z_FINISH);
+		crc32(crc32(0L, NULL, 0L), s + off, zs.total_in);
+		deflateEnd(&zs);
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, l, level = -1;
+	int64_t i, n, raw_len, data_len = 0, data_m = 0, n_blk;
+	uint8_t *raw, *data = 0, *buf;
+	char mode[3] = "w";
+	double t;
+	BGZF *fp;
+
+	while ((c = getopt(argc, argv, "l:")) >= 0) {
+		switch (c) {
+			case 'l': level = atoi(optarg); break;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: bgzfbench [-l level] <in.bgzf>\n");
+		return 1;
+	}
+	if ((raw = read_file(argv[optind], &raw_len)) == 0) {
+		fprintf(stderr, "[%s] fail to read file '%s'.\n", __func__, argv[optind]);
+		return 1;
+	}
+	buf = malloc(BLK_SIZE * 2);
+	if (level >= 0 && level <= 9) mode[1] = '0' + level;
+	// keep the uncompressed data for the deflate runs
+	if ((fp = bgzf_open(argv[optind], "r")) == 0) {
+		fprintf(stderr, "[%s] fail to open file '%s'.\n", __func__, argv[optind]);
+		return 1;
+	}
+	while (bgzf_read_block(fp) == 0 && fp->block_length > 0) {
+		if (data_len + fp->block_length > data_m) data = realloc(data, data_m = (data_len + fp->block_length) * 2);
+		memcpy(data + data_len, fp->uncompressed_block, fp->block_length);
+		data_len += fp->block_length;
+	}
+	bgzf_close(fp);
+	// inflate through BGZF and with a stream per block
+	fp = bgzf_open(argv[optind], "r");
+	t = realtime();
+	for (n_blk = 0; bgzf_read_block(fp) == 0 && fp->block_length > 0; ++n_blk);
+	t = realtime() - t;
+	bgzf_close(fp);
+	printf("inflate_reuse\t%lld blocks\t%.3f sec\t%.0f blocks/s\n", (long long)n_blk, t, n_blk / t);
+	t = realtime();
+	n = inflate_init_each(raw, raw_len, buf);
+	t = realtime() - t;
+	if (n < 0) {
+		fprintf(stderr, "[%s] '%s' is not a BGZF file.\n", __func__, argv[optind]);
+		return 1;
+	}
+	printf("inflate_init\t%lld blocks\t%.3f sec\t%.0f blocks/s\n", (long long)n, t, n / t);
+	// deflate through BGZF and with a stream per block
+	fp = bgzf_mem_open(mode);
+	t = realtime();
+	for (i = 0; i < data_len; i += l) {
+		l = data_len - i < BLK_SIZE? data_len - i : BLK_SIZE;
+		bgzf_write(fp, data + i, l);
+	}
+	bgzf_flush(fp);
+	t = realtime() - t;
+	n = (data_len + BLK_SIZE - 1) / BLK_SIZE;
+	printf("deflate_reuse\t%lld blocks\t%.3f sec\t%.0f blocks/s\n", (long long)n, t, n / t);
+	bgzf_close(fp);
+	t = realtime();
+	n = deflate_init_each(data, data_len, buf, level >= 0 && level <= 9? level : Z_DEFAULT_COMPRESSION);
+	t = realtime() - t;
+	printf("deflate_init\t%lld blocks\t%.3f sec\t%.0f blocks/s\n", (long long)n, t, n / t);
+	free(buf); free(data); free(raw);
+	return 0;
+}
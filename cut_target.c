@@ -24,31 +24,30 @@ typedef struct {
 	char *ref;
 	faidx_t *fai;
 	errmod_t *em;
+	bam_plp_col_t col;
 } ct_t;
 
 static uint16_t gencns(ct_t *g, int n, const bam_pileup1_t *plp)
 {
 	int i, j, ret, tmp, k, sum[4], qual;
 	float q[16];
+	bam_plp_col_t *c = &g->col;
 	if (n > g->max_bases) { // enlarge g->bases
 		g->max_bases = n;
 		kroundup32(g->max_bases);
 		g->bases = realloc(g->bases, g->max_bases * 2);
 	}
+	bam_plp_col(c, n, plp);
 	for (i = k = 0; i < n; ++i) {
-		const bam_pileup1_t *p = plp + i;
-		uint8_t *seq;
-		int q, baseQ, b;
-		if (p->is_refskip || p->is_del) continue;
-		baseQ = bam1_qual(p->b)[p->qpos];
-		if (baseQ < g->min_baseQ) continue;
-		seq = bam1_seq(p->b);
-		b = bam_nt16_nt4_table[bam1_seqi(seq, p->qpos)];
+		int q, b;
+		if (c->flag[i] & (BAM_PLP_DEL|BAM_PLP_REFSKIP)) continue;
+		if (c->baseQ[i] < g->min_baseQ) continue;
+		b = bam_nt16_nt4_table[c->base4[i]];
 		if (b > 3) continue;
-		q = baseQ < p->b->core.qual? baseQ : p->b->core.qual;
+		q = c->baseQ[i] < c->mapQ[i]? c->baseQ[i] : c->mapQ[i];
 		if (q < 4) q = 4;
 		if (q > 63) q = 63;
-		g->bases[k++] = q<<5 | bam1_strand(p->b)<<4 | b;
+		g->bases[k++] = q<<5 | c->strand[i]<<4 | b;
 	}
 	if (k == 0) return 0;
 	errmod_cal(g->em, k, 4, g->bases, q);
@@ -188,6 +187,7 @@ int main_cut_target(int argc, char *argv[])
 		fai_destroy(g.fai); free(g.ref);
 	}
 	errmod_destroy(g.em);
+	bam_plp_col_destroy(&g.col);
 	free(g.bases);
 	return 0;
 }
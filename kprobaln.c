@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "kprobaln.h"
 
 /*****************************************
@@ -38,6 +39,14 @@
 #define EM .33333333333
 
 static float g_qual2prob[256];
+static pthread_once_t g_qual2prob_once = PTHREAD_ONCE_INIT;
+
+static void qual2prob_init(void)
+{
+	int i;
+	for (i = 0; i < 256; ++i)
+		g_qual2prob[i] = pow(10, -i/10.);
+}
 
 #define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=((k)-x+1)*3; }
 
@@ -94,9 +103,7 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
 	// initialize qual
 	_qual = calloc(l_query, sizeof(float));
-	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
-			g_qual2prob[i] = pow(10, -i/10.);
+	pthread_once(&g_qual2prob_once, qual2prob_init); // the table is shared by threads
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
 	// initialize transition probability
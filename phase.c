@@ -508,7 +508,7 @@ static int gl2cns(float q[16])
 int main_phase(int argc, char *argv[])
 {
 	extern void bam_init_header_hash(bam_header_t *header);
-	int c, tid, pos, vpos = 0, n, lasttid = -1, max_vpos = 0;
+	int c, tid, pos, vpos = 0, n, lasttid = -1, max_vpos = 0, n_threads = 1;
 	const bam_pileup1_t *plp;
 	bam_plp_t iter;
 	bam_header_t *h;
@@ -523,8 +523,9 @@ int main_phase(int argc, char *argv[])
 	memset(&g, 0, sizeof(phaseg_t));
 	g.flag = FLAG_FIX_CHIMERA;
 	g.min_varLOD = 37; g.k = 13; g.min_baseQ = 13; g.max_depth = 256;
-	while ((c = getopt(argc, argv, "Q:eFq:k:b:l:D:A:")) >= 0) {
+	while ((c = getopt(argc, argv, "Q:eFq:k:b:l:D:A:@:")) >= 0) {
 		switch (c) {
+			case '@': n_threads = atoi(optarg); break;
 			case 'D': g.max_depth = atoi(optarg); break;
 			case 'q': g.min_varLOD = atoi(optarg); break;
 			case 'Q': g.min_baseQ = atoi(optarg); break;
@@ -547,6 +548,7 @@ int main_phase(int argc, char *argv[])
 //		fprintf(stderr, "         -l FILE   list of sites to phase [null]\n");
 		fprintf(stderr, "         -F        do not attempt to fix chimeras\n");
 		fprintf(stderr, "         -A        drop reads with ambiguous phase\n");
+		fprintf(stderr, "         -@ INT    number of BAM compression threads (with -b) [1]\n");
 //		fprintf(stderr, "         -e        do not discover SNPs (effective with -l)\n");
 		fprintf(stderr, "\n");
 		return 1;
@@ -563,7 +565,10 @@ int main_phase(int argc, char *argv[])
 		strcpy(s, g.pre); strcat(s, ".0.bam"); g.out[0] = bam_open(s, "w");
 		strcpy(s, g.pre); strcat(s, ".1.bam"); g.out[1] = bam_open(s, "w");
 		strcpy(s, g.pre); strcat(s, ".chimera.bam"); g.out[2] = bam_open(s, "w");
-		for (c = 0; c <= 2; ++c) bam_header_write(g.out[c], h);
+		for (c = 0; c <= 2; ++c) {
+			bam_header_write(g.out[c], h);
+			if (n_threads > 1) bgzf_mt(g.out[c], n_threads, 256);
+		}
 		free(s);
 	}
 
@@ -158,6 +158,12 @@ int sampileup(samfile_t *fp, int mask, bam_pileup_f func, void *func_data)
 	return 0;
 }
 
+int samthreads(samfile_t *fp, int n_threads, int n_sub_blks)
+{
+	if (!(fp->type & TYPE_BAM)) return -1;
+	return bgzf_mt(fp->x.bam, n_threads, n_sub_blks);
+}
+
 char *samfaipath(const char *fn_ref)
 {
 	char *fn_list = 0;
@@ -91,6 +91,18 @@ extern "C" {
 
 	char *samfaipath(const char *fn_ref);
 
+	/*!
+	  @abstract     Compress or decompress BAM with multiple threads
+	  @param  fp    BAM file handler
+	  @param  n_threads   number of threads
+	  @param  n_sub_blks  number of blocks each thread processes per batch
+	  @return       0 on success; -1 if fp is not a BAM file
+
+	  @discussion   Read-ahead is wasted on files accessed by region
+	  queries, so only enable it on input files scanned from the start.
+	 */
+	int samthreads(samfile_t *fp, int n_threads, int n_sub_blks);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "sam_header.h"
 #include "sam.h"
 #include "faidx.h"
@@ -29,6 +31,7 @@ static void *g_bed;
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
+const uint64_t *bed_get(const void *_h, const char *chr, int *n);
 
 static int process_aln(const bam_header_t *h, bam1_t *b)
 {
@@ -114,24 +117,211 @@ static int count_func(const bam1_t *b, void *data)
 	return 0;
 }
 
+// append the regions in the BED on the references in h
+static bam_region_t *bed2regions(const bam_header_t *h, bam_region_t *regs, int *n)
+{
+	int i, j, m = *n;
+	for (i = 0; i < h->n_targets; ++i) {
+		int n_bed;
+		const uint64_t *a = bed_get(g_bed, h->target_name[i], &n_bed);
+		if (*n + n_bed > m) {
+			m = *n + n_bed;
+			regs = (bam_region_t*)realloc(regs, m * sizeof(bam_region_t));
+		}
+		for (j = 0; j < n_bed; ++j, ++*n) {
+			regs[*n].tid = i;
+			regs[*n].beg = a[j]>>32;
+			regs[*n].end = (uint32_t)a[j];
+		}
+	}
+	return regs;
+}
+
+/* Process the alignments overlapping any of the regions once each, in the
+ * file order, and then the reads without coordinates, which are kept by
+ * -L as when the whole file is scanned. */
+static int view_regions(samfile_t *in, samfile_t *out, const bam_index_t *idx, const bam_region_t *regs, int n, int *count)
+{
+	bam_iter_t iter;
+	bam1_t *b = bam_init1();
+	int64_t off, hdr_off = bam_tell(in->x.bam);
+	int r;
+	iter = bam_iter_query_many(idx, regs, n);
+	while ((r = bam_iter_read(in->x.bam, iter, b)) >= 0) {
+		if (!process_aln(in->header, b)) {
+			if (out) samwrite(out, b);
+			++*count;
+		}
+	}
+	bam_iter_destroy(iter);
+	if (r == -1 && (off = bam_index_no_coor_off(idx)) >= 0) {
+		bam_seek(in->x.bam, off? off : hdr_off, SEEK_SET);
+		while ((r = bam_read1(in->x.bam, b)) >= 0) {
+			if (!process_aln(in->header, b)) {
+				if (out) samwrite(out, b);
+				++*count;
+			}
+		}
+	}
+	bam_destroy1(b);
+	return r < -1? -1 : 0;
+}
+
+/* With -@ on an indexed BAM, the file is cut into parts at alignment
+ * boundaries found in the index. Each worker reads parts with its own
+ * handle and keeps the output of a part in memory, compressed for BAM;
+ * the main thread writes the parts in order as they complete. SAM text
+ * buffers are recycled, as they are large and touching fresh pages for
+ * every part is slow. */
+typedef struct {
+	uint64_t beg, end; // virtual offsets; end==0 for the end of file
+	int done, ret, count;
+	uint8_t *data; // BGZF blocks
+	int64_t len;
+	kstring_t str; // SAM text
+} view_part_t;
+
+typedef struct {
+	const char *fn, *mode; // mode for bgzf_mem_open(), or NULL for SAM output
+	const bam_header_t *h;
+	int of_type, is_count;
+	int n_parts, next, n_written, max_ahead, n_pool;
+	view_part_t *parts;
+	kstring_t *pool; // SAM text buffers written out, at most max_ahead
+	pthread_mutex_t lock;
+	pthread_cond_t cv_done, cv_free;
+} view_mt_t;
+
+static int view_part(view_mt_t *v, view_part_t *p, bamFile fp, BGZF *mem, bam1_t *b)
+{
+	int r = 0;
+	bam_seek(fp, p->beg, SEEK_SET);
+	while ((p->end == 0 || (uint64_t)bam_tell(fp) < p->end) && (r = bam_read1(fp, b)) >= 0) {
+		if (process_aln(v->h, b)) continue;
+		++p->count;
+		if (v->is_count) continue;
+		if (mem) bam_write1(mem, b);
+		else {
+			char *s = bam_format1_core(v->h, b, v->of_type);
+			kputs(s, &p->str); kputc('\n', &p->str);
+			free(s);
+		}
+	}
+	if (p->end && r < 0) r = -2; // the part ends before its last alignment
+	if (mem && bgzf_mem_take(mem, &p->data, &p->len) < 0) return -1;
+	return r < -1? -1 : 0;
+}
+
+static void *view_worker(void *data)
+{
+	view_mt_t *v = (view_mt_t*)data;
+	bamFile fp = bam_open(v->fn, "r");
+	BGZF *mem = v->mode? bgzf_mem_open(v->mode) : 0;
+	bam1_t *b = bam_init1();
+	for (;;) {
+		view_part_t *p;
+		pthread_mutex_lock(&v->lock);
+		while (v->next < v->n_parts && v->next >= v->n_written + v->max_ahead)
+			pthread_cond_wait(&v->cv_free, &v->lock);
+		p = v->next < v->n_parts? &v->parts[v->next++] : 0;
+		if (p && v->n_pool) p->str = v->pool[--v->n_pool];
+		pthread_mutex_unlock(&v->lock);
+		if (p == 0) break;
+		p->ret = fp? view_part(v, p, fp, mem, b) : -1;
+		pthread_mutex_lock(&v->lock);
+		p->done = 1;
+		pthread_cond_broadcast(&v->cv_done);
+		pthread_mutex_unlock(&v->lock);
+	}
+	bam_destroy1(b);
+	if (mem) bgzf_close(mem);
+	if (fp) bam_close(fp);
+	return 0;
+}
+
+// process an indexed BAM in parts on n_threads threads; return 1 if the file cannot be cut
+static int view_mt(const char *fn, samfile_t *in, samfile_t *out, const bam_index_t *idx, const char *bam_mode, int of_type, int n_threads, int *count)
+{
+	view_mt_t v;
+	pthread_t *tid;
+	struct stat st;
+	uint64_t *cut;
+	int i, ret = 0;
+	if (stat(fn, &st) != 0) return 1;
+	// about 1MB of input per part, and several parts per thread to balance the load
+	i = st.st_size>>20 > n_threads * 4? st.st_size>>20 : n_threads * 4;
+	if ((cut = bam_index_cut(idx, st.st_size, i, &v.n_parts)) == 0) return 1;
+	v.fn = fn, v.h = in->header, v.of_type = of_type, v.is_count = (out == 0);
+	v.mode = out? bam_mode : 0;
+	v.next = v.n_written = 0, v.max_ahead = n_threads * 2;
+	v.parts = (view_part_t*)calloc(v.n_parts, sizeof(view_part_t));
+	v.pool = (kstring_t*)calloc(v.max_ahead, sizeof(kstring_t));
+	v.n_pool = 0;
+	for (i = 0; i < v.n_parts; ++i) {
+		v.parts[i].beg = cut[i];
+		v.parts[i].end = i + 1 < v.n_parts? cut[i+1] : 0;
+	}
+	free(cut);
+	if (g_library) { // the library table is built on first use; do it before the threads share the header
+		bam1_t *b = bam_init1();
+		bam_get_library(in->header, b);
+		bam_destroy1(b);
+	}
+	pthread_mutex_init(&v.lock, 0);
+	pthread_cond_init(&v.cv_done, 0);
+	pthread_cond_init(&v.cv_free, 0);
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, view_worker, &v);
+	for (i = 0; i < v.n_parts; ++i) {
+		view_part_t *p = &v.parts[i];
+		pthread_mutex_lock(&v.lock);
+		while (!p->done) pthread_cond_wait(&v.cv_done, &v.lock);
+		pthread_mutex_unlock(&v.lock);
+		if (p->ret < 0) ret = -1;
+		if (ret == 0 && p->len && bgzf_write_blocks(out->x.bam, p->data, p->len) < 0) ret = -1;
+		if (ret == 0 && p->str.l && fwrite(p->str.s, 1, p->str.l, out->x.tamw) != p->str.l) ret = -1;
+		*count += p->count;
+		free(p->data);
+		pthread_mutex_lock(&v.lock);
+		if (p->str.m) {
+			p->str.l = 0;
+			v.pool[v.n_pool++] = p->str;
+		}
+		++v.n_written;
+		pthread_cond_broadcast(&v.cv_free);
+		pthread_mutex_unlock(&v.lock);
+	}
+	for (i = 0; i < n_threads; ++i) pthread_join(tid[i], 0);
+	free(tid);
+	pthread_cond_destroy(&v.cv_free);
+	pthread_cond_destroy(&v.cv_done);
+	pthread_mutex_destroy(&v.lock);
+	for (i = 0; i < v.n_pool; ++i) free(v.pool[i].s);
+	free(v.pool); free(v.parts);
+	return ret;
+}
+
 static int usage(int is_long_help);
 
 int main_samview(int argc, char *argv[])
 {
 	int c, is_header = 0, is_header_only = 0, is_bamin = 1, ret = 0, compress_level = -1, is_bamout = 0, is_count = 0;
-	int of_type = BAM_OFDEC, is_long_help = 0;
-	int count = 0;
+	int of_type = BAM_OFDEC, is_long_help = 0, n_threads = 1, write_index = 0;
+	int count = 0, r_mt = 1;
 	samfile_t *in = 0, *out = 0;
+	bam_index_t *idx = 0;
 	char in_mode[5], out_mode[5], *fn_out = 0, *fn_list = 0, *fn_ref = 0, *fn_rg = 0;
 
 	/* parse command-line options */
 	strcpy(in_mode, "r"); strcpy(out_mode, "w");
-	while ((c = getopt(argc, argv, "SbBct:h1Ho:q:f:F:ul:r:xX?T:R:L:s:Q:")) >= 0) {
+	while ((c = getopt(argc, argv, "SbBct:h1Ho:q:f:F:ul:r:xX?T:R:L:s:Q:@:i")) >= 0) {
 		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
 		case 's': g_subsam = atof(optarg); break;
 		case 'c': is_count = 1; break;
 		case 'S': is_bamin = 0; break;
 		case 'b': is_bamout = 1; break;
+		case 'i': write_index = 1; break;
 		case 't': fn_list = strdup(optarg); is_bamin = 0; break;
 		case 'h': is_header = 1; break;
 		case 'H': is_header_only = 1; break;
@@ -169,6 +359,10 @@ int main_samview(int argc, char *argv[])
 		strcat(out_mode, tmp);
 	}
 	if (argc == optind) return usage(is_long_help); // potential memory leak...
+	if (write_index && (!is_bamout || fn_out == 0 || is_count)) {
+		fprintf(stderr, "[main_samview] option -i requires BAM output to a file (-b and -o).\n");
+		return 1;
+	}
 
 	// read the list of read groups
 	if (fn_rg) {
@@ -208,15 +402,53 @@ int main_samview(int argc, char *argv[])
 		ret = 1;
 		goto view_end;
 	}
+	if (n_threads > 1 && argc == optind + 1 && is_bamin && !g_bed && !write_index && !is_header_only && strcmp(argv[optind], "-"))
+		idx = bam_index_load_local(argv[optind]); // process the file in parts in parallel
+	if (n_threads > 1 && out && idx == 0) samthreads(out, n_threads, 256);
+	if (n_threads > 1 && argc == optind + 1 && idx == 0) samthreads(in, n_threads, 256);
+	if (write_index) bam_index_otf_init(out->x.bam, out->header->n_targets);
 	if (is_header_only) goto view_end; // no need to print alignments
 
-	if (argc == optind + 1) { // convert/print the entire file
+	if (idx && (r_mt = view_mt(argv[optind], in, is_count? 0 : out, idx, is_bamout? out_mode : 0, of_type, n_threads, &count)) <= 0) {
+		if (r_mt < 0) {
+			fprintf(stderr, "[main_samview] truncated file or corrupt BAM index file.\n");
+			ret = 1;
+		}
+	} else if (argc == optind + 1 && g_bed && is_bamin && (idx = bam_index_load_local(argv[optind])) != 0) { // stream the BED regions
+		bam_region_t *regs = 0;
+		int n = 0;
+		regs = bed2regions(in->header, regs, &n);
+		if (view_regions(in, is_count? 0 : out, idx, regs, n, &count) < 0) {
+			fprintf(stderr, "[main_samview] retrieval of the BED regions failed due to truncated file or corrupt BAM index file\n");
+			ret = 1;
+		}
+		free(regs);
+	} else if (argc == optind + 1) { // convert/print the entire file
 		bam1_t *b = bam_init1();
 		int r;
-		while ((r = samread(in, b)) >= 0) { // read one alignment from `in'
-			if (!process_aln(in->header, b)) {
-				if (!is_count) samwrite(out, b); // write the alignment to `out'
-				count++;
+		if (idx) { // no alignments in the index to cut the file at
+			if (out) samthreads(out, n_threads, 256);
+			samthreads(in, n_threads, 256);
+		}
+		if (is_bamin) { // read BAM in batches
+			bam_batch_t *bb = bam_batch_init();
+			while ((r = bam_read_batch(in->x.bam, bb, 4096)) != 0) {
+				int i;
+				for (i = 0; i < bb->n; ++i) {
+					if (!process_aln(in->header, &bb->b[i])) {
+						if (!is_count) samwrite(out, &bb->b[i]);
+						count++;
+					}
+				}
+				if (r < 0) break;
+			}
+			bam_batch_destroy(bb);
+		} else {
+			while ((r = samread(in, b)) >= 0) { // read one alignment from `in'
+				if (!process_aln(in->header, b)) {
+					if (!is_count) samwrite(out, b); // write the alignment to `out'
+					count++;
+				}
 			}
 		}
 		if (r < -1) {
@@ -226,7 +458,6 @@ int main_samview(int argc, char *argv[])
 		bam_destroy1(b);
 	} else { // retrieve alignments in specified regions
 		int i;
-		bam_index_t *idx = 0;
 		if (is_bamin) idx = bam_index_load(argv[optind]); // load BAM index
 		if (idx == 0) { // index is unavailable
 			fprintf(stderr, "[main_samview] random alignment retrieval only works for indexed BAM files.\n");
@@ -252,13 +483,14 @@ int main_samview(int argc, char *argv[])
 				break;
 			}
 		}
-		bam_index_destroy(idx); // destroy the BAM index
 	}
 
 view_end:
+	if (idx) bam_index_destroy(idx); // destroy the BAM index
 	if (is_count && ret == 0) {
 		printf("%d\n", count);
 	}
+	if (write_index && out && bam_index_otf_save(out->x.bam, fn_out) < 0) ret = 1;
 	// close files, free and return
 	free(fn_list); free(fn_ref); free(fn_out); free(g_library); free(g_rg); free(fn_rg);
 	if (g_bed) bed_destroy(g_bed);
@@ -284,11 +516,14 @@ static int usage(int is_long_help)
 	fprintf(stderr, "         -S       input is SAM\n");
 	fprintf(stderr, "         -u       uncompressed BAM output (force -b)\n");
 	fprintf(stderr, "         -1       fast compression (force -b)\n");
+	fprintf(stderr, "         -i       write the index FILE.bai of sorted BAM output (requires -b -o FILE)\n");
+	fprintf(stderr, "         -@ INT   number of BAM (de)compression threads; on an indexed BAM,\n");
+	fprintf(stderr, "                  number of threads processing parts of the file [1]\n");
 	fprintf(stderr, "         -x       output FLAG in HEX (samtools-C specific)\n");
 	fprintf(stderr, "         -X       output FLAG in string (samtools-C specific)\n");
 	fprintf(stderr, "         -c       print only the count of matching records\n");
 	fprintf(stderr, "         -B       collapse the backward CIGAR operation\n");
-	fprintf(stderr, "         -L FILE  output alignments overlapping the input BED FILE [null]\n");
+	fprintf(stderr, "         -L FILE  output alignments overlapping the input BED FILE; uses the index if present [null]\n");
 	fprintf(stderr, "         -t FILE  list of reference names and lengths (force -S) [null]\n");
 	fprintf(stderr, "         -T FILE  reference sequence file (force -S) [null]\n");
 	fprintf(stderr, "         -o FILE  output file name [stdout]\n");
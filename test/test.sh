@@ -0,0 +1,100 @@
+#!/bin/sh
+# Regression checks run by `make check' from the top directory.
+
+ST=./samtools
+T=${TMPDIR:-/tmp}/samtools-check.$$
+n_fail=0
+mkdir -p $T || exit 1
+trap 'rm -fr $T' 0
+
+fail() { echo "FAIL: $1"; n_fail=`expr $n_fail + 1`; }
+pass() { echo "ok: $1"; }
+
+# a sorted SAM with two references spanning many BGZF blocks and some unmapped reads
+awk 'BEGIN {
+	srand(11);
+	print "@SQ\tSN:c1\tLN:2000000"; print "@SQ\tSN:c2\tLN:500000";
+	s = "ACGTACGTAC"; q = "IIIIIIIIII";
+	for (i = 0; i < 5; ++i) { s = s s; q = q q; } s = substr(s, 1, 100); q = substr(q, 1, 100);
+	for (t = 1; t <= 2; ++t) {
+		len = t == 1? 2000000 : 500000;
+		for (p = 1; p < len - 200; p += int(rand() * 40) + 1)
+			printf("r%d_%d\t%d\tc%d\t%d\t%d\t100M\t*\t0\t0\t%s\t%s\n", t, p, rand() < .5? 0 : 16, t, p, int(rand() * 60), s, q);
+	}
+	for (i = 0; i < 1000; ++i) printf("u%d\t4\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n", i, s, q);
+}' > $T/in.sam
+$ST view -bS $T/in.sam > $T/in.bam 2>/dev/null || { echo "cannot create the test BAM"; exit 1; }
+$ST view $T/in.bam > $T/in.txt
+
+# cat and reheader copy the blocks after the header verbatim
+$ST cat -o $T/cat.bam $T/in.bam $T/in.bam
+cat $T/in.txt $T/in.txt > $T/cat.exp
+if $ST view $T/cat.bam 2>$T/err | cmp -s - $T/cat.exp && ! test -s $T/err; then pass "cat"; else fail "cat"; fi
+$ST view -H $T/in.bam | sed 's/LN:500000/LN:500000\tM5:0/' > $T/h.sam
+$ST reheader $T/h.sam $T/in.bam > $T/rh.bam
+if $ST view $T/rh.bam 2>$T/err | cmp -s - $T/in.txt && ! test -s $T/err \
+	&& $ST view -H $T/rh.bam | cmp -s - $T/h.sam; then pass "reheader"; else fail "reheader"; fi
+
+# index -@ writes the same index as the serial indexer, or fails the same way,
+# on sorted, re-blocked (uncompressed), truncated and unsorted inputs
+$ST view -u $T/in.bam > $T/ub.bam 2>/dev/null
+head -c 700000 $T/in.bam > $T/tr.bam
+{ $ST view -H $T/in.bam; grep '^r1_' $T/in.txt | tail -1; cat $T/in.txt; } | $ST view -bS - > $T/us.bam 2>/dev/null
+for f in in ub tr us cat; do
+	for c in "" -c; do
+		for t in 1 4; do
+			cp $T/$f.bam $T/$f$t.bam
+			$ST index $c -@$t $T/$f$t.bam 2>$T/$f$t.err
+		done
+		x=bai; test -z "$c" || x=csi
+		if { test ! -f $T/${f}1.bam.$x && test ! -f $T/${f}4.bam.$x || cmp -s $T/${f}1.bam.$x $T/${f}4.bam.$x; } \
+			&& sed "s/${f}1/${f}4/g" $T/${f}1.err | cmp -s - $T/${f}4.err; then pass "index ${c:+$c }-@4 $f"; else fail "index ${c:+$c }-@4 $f"; fi
+		rm -f $T/${f}[14].bam*
+	done
+done
+
+# merge -@ gives the same alignments as merge, with and without blocks copied
+$ST index $T/in.bam
+$ST view -b $T/in.bam c1 > $T/d1.bam
+$ST view -b $T/in.bam c2 > $T/d2.bam
+for f in "d2 d1" "d1 in"; do
+	set -- `for x in $f; do echo $T/$x.bam; done`
+	$ST merge -f $T/m1.bam "$@" && $ST merge -f -@4 $T/m4.bam "$@" 2>$T/err
+	$ST view -h $T/m1.bam > $T/m1.sam; $ST view -h $T/m4.bam > $T/m4.sam
+	if cmp -s $T/m1.sam $T/m4.sam && ! test -s $T/err; then pass "merge -@4 $f"; else fail "merge -@4 $f"; fi
+done
+
+# sort -@ cuts shorter runs than sort; alignments at the same position must keep the same order
+awk 'BEGIN {
+	srand(7);
+	print "@SQ\tSN:c1\tLN:10000";
+	s = "ACGTACGTAC"; q = "IIIIIIIIII";
+	for (i = 0; i < 5; ++i) { s = s s; q = q q; } s = substr(s, 1, 50); q = substr(q, 1, 50);
+	for (i = 0; i < 40000; ++i)
+		printf("t%d\t%d\tc1\t%d\t60\t50M\t*\t0\t0\t%s\t%s\n", i, rand() < .5? 0 : 16, int(rand() * 500) + 1, s, q);
+}' | $ST view -bS - > $T/ties.bam 2>/dev/null
+for m in 1000000 100000000; do
+	$ST sort -m $m $T/ties.bam $T/s1 2>/dev/null && $ST sort -@4 -m $m $T/ties.bam $T/s4 2>/dev/null
+	$ST view $T/s1.bam > $T/s1.sam; $ST view $T/s4.bam > $T/s4.sam
+	if cmp -s $T/s1.sam $T/s4.sam; then pass "sort -@4 -m $m"; else fail "sort -@4 -m $m"; fi
+done
+
+# mpileup -@ calls the same columns as mpileup, including those past 2^29 on a long reference
+awk 'BEGIN {
+	srand(13);
+	print "@SQ\tSN:c1\tLN:2500000"; print "@SQ\tSN:big\tLN:700000000";
+	s = "ACGTACGTAC"; q = "IIIIIIIIII";
+	for (i = 0; i < 5; ++i) { s = s s; q = q q; } s = substr(s, 1, 100); q = substr(q, 1, 100);
+	for (p = 1; p < 2500000 - 200; p += int(rand() * 400) + 1)
+		printf("r%d\t%d\tc1\t%d\t60\t100M\t*\t0\t0\t%s\t%s\n", p, rand() < .5? 0 : 16, p, s, q);
+	for (i = 0; i < 4; ++i) {
+		printf("b%d\t0\tbig\t100\t60\t100M\t*\t0\t0\t%s\t%s\n", i, s, q);
+		printf("e%d\t0\tbig\t600000000\t60\t100M\t*\t0\t0\t%s\t%s\n", i, s, q);
+	}
+}' | $ST view -bS - > $T/long.bam 2>/dev/null && $ST sort $T/long.bam $T/pl 2>/dev/null && $ST index -c $T/pl.bam
+$ST mpileup -ug $T/pl.bam > $T/p1.bcf 2>/dev/null
+$ST mpileup -@4 -ug $T/pl.bam > $T/p4.bcf 2>/dev/null
+n=`bcftools/bcftools view $T/p4.bcf 2>/dev/null | awk '$1 == "big" && $2 > 536870912' | wc -l`
+if cmp -s $T/p1.bcf $T/p4.bcf && test $n -eq 100; then pass "mpileup -@4 -ug"; else fail "mpileup -@4 -ug"; fi
+
+test $n_fail -eq 0